@@ -15,10 +15,199 @@ Copyright 2024 Michael Keras.
 */
 
 #include "EmbeddedSparkplugPayloads.h"
+#include <limits.h>
+
+// Stream encode target. Writes are staged and handed to the StreamFunction in blocks of up to staging_size bytes
+typedef struct {
+    StreamFunction write;
+    void* ctx;
+    uint8_t* staging;  // Allocated on the first stream encode, NULL while staging_size is 0
+    size_t staging_size;
+    size_t staged;
+} _EncodeStream;
+
+// State types, see the sections using them
+
+typedef struct {
+    FunctionalBasicTag* tag;  // The tag the entry was built from
+    const char* name;
+    int alias;
+    size_t offset;  // Start of the pre-encoded birth fields in _BirthCache.bytes
+    size_t length;
+    size_t data_offset;  // Start of the NDATA fields, they end with the birth fields
+    SparkplugDataType datatype;
+    pb_byte_t datatype_field[6];  // Key and varint of the datatype field
+    uint8_t datatype_field_length;
+} _BirthCacheEntry;
+
+typedef struct {
+    BasicValue value;  // The tag's value when the first fragment was made
+    size_t bytes_offset;  // String and bytes contents, copied to _BirthCache.frozen_bytes
+    size_t bytes_length;
+    bool read_only;
+} _FrozenValue;
+
+typedef struct {
+    _BirthCacheEntry* entries;
+    size_t entries_allocated;
+    size_t count;
+    uint8_t* bytes;
+    size_t bytes_allocated;
+    // Values of the birth being sent in fragments, one per entry
+    _FrozenValue* frozen;
+    size_t frozen_allocated;
+    uint8_t* frozen_bytes;
+    size_t frozen_bytes_allocated;
+} _BirthCache;
+
+typedef struct {
+    bool active;  // From the first fragment of a birth until its last
+    bool is_historical;
+    uint64_t timestamp;
+    int sequence;
+    size_t total_length;
+    size_t next_metric;  // Metric the next fragment starts in, the metric count when only seq is left
+    size_t next_position;  // Position of next_metric in the payload, 0 before the payload timestamp
+} _NBIRTHFragments;
+
+typedef struct {
+    uint32_t* names;  // Registry index + 1 per slot, 0 is an empty slot
+    uint32_t* aliases;  // Only tags with an alias, a negative alias means none
+    size_t slots;  // Power of two, at least twice the tag count
+    FunctionalBasicTag** tags;  // Tag at each registry index when the index was built
+    const char* last_name;  // Name of the last tag when the index was built
+    size_t count;  // Registry size when the index was built
+    bool valid;  // Cleared when tags are added or removed
+} _TagIndex;
+
+typedef struct {
+    size_t* indexes;
+    size_t allocated;
+    size_t count;
+    size_t tags_count;  // Registry size when the list was built
+    bool valid;
+} _DirtyTags;
+
+typedef struct {
+    size_t next;  // Position in the changed tag list (or the registry) of the next metric to send
+    bool pending;
+} _NDATASplit;
+
+typedef struct {
+    SparkplugTagData* entries;
+    size_t slots;  // Power of two, 0 while no handler was set
+    size_t used;  // Entries holding a tag, including removed handlers
+} _TagCommands;
+
+typedef struct {
+    FunctionalBasicTag* tag;
+    size_t index;  // Position of the tag when the list was built
+} _ScanClassEntry;
+
+typedef struct {
+    _ScanClassEntry* order;  // Tags grouped by scan class
+    size_t starts[SPARKPLUG_SCAN_CLASSES + 1];  // order[starts[n]] to order[starts[n + 1] - 1] are the tags of class n
+    size_t allocated;
+    size_t tags_count;  // Tag count when the list was built
+    bool valid;
+} _ScanClasses;
+
+typedef struct {
+    uint8_t* buffer;
+    size_t size;
+    size_t used;
+} _DecodeArena;
+
+typedef struct {
+    FunctionalBasicTag* tag;
+    BasicValue value;
+    BufferValue view;  // String and bytes values, bytesValue is pointed here at commit
+    size_t view_offset;  // Position of the copied value in _NCMDStage.bytes
+} _StagedWrite;
+
+typedef struct {
+    _StagedWrite* writes;
+    size_t allocated;
+    size_t count;
+    // A streamed NCMD reuses its input buffer for every metric, so values are copied here
+    bool copy_values;
+    uint8_t* bytes;
+    size_t bytes_allocated;
+    size_t bytes_used;
+} _NCMDStage;
 
-static bool _NODE_INITIALIZED = false;
-static BufferValue* _ENCODE_BUFFER = NULL;
-static StreamFunction* _ENCODE_STREAM = NULL;
+/*
+Node context
+
+Everything kept between calls, the encode target, the caches and the NCMD state, belongs to a
+SparkplugContext. Every function works on the current context, selected with setSparkplugContext,
+so a process can run any number of nodes by switching contexts. The default context is used until
+another is selected. A context created with its own tag set only sees the tags added to it, the
+default context sees every tag in the BasicTag registry.
+*/
+
+struct SparkplugContext {
+    bool node_initialized;
+    BufferValue* encode_buffer;
+    _EncodeStream encode_stream;
+    size_t iovec_reference_min;
+    _BirthCache birth_cache;
+    _TagIndex tag_index;
+    _DirtyTags dirty_tags;
+    _NDATASplit ndata_split;
+    _NBIRTHFragments nbirth_fragments;
+    _TagCommands tag_commands;
+    _ScanClasses scan_classes;
+    _DecodeArena decode_arena;
+    _NCMDStage ncmd_stage;
+    bool device;  // Set up by initializeSparkplugDevice, has no bdSeq, Rebirth or Scan Rate tags
+    bool own_tags;
+    FunctionalBasicTag** tags;  // Only used with own_tags, in the order they were added
+    size_t tags_count;
+    size_t tags_allocated;
+};
+
+#define _ENCODE_STAGING_SIZE_DEFAULT 256
+#define _IOVEC_REFERENCE_MIN_DEFAULT 128
+
+static SparkplugContext _DEFAULT_CONTEXT = {
+    .encode_stream = {NULL, NULL, NULL, _ENCODE_STAGING_SIZE_DEFAULT, 0},
+    .iovec_reference_min = _IOVEC_REFERENCE_MIN_DEFAULT,
+};
+
+// Define SPARKPLUG_THREAD_LOCAL_CONTEXT to select contexts per thread, nodes can then run in separate threads
+#ifdef SPARKPLUG_THREAD_LOCAL_CONTEXT
+static _Thread_local SparkplugContext* _CTX = &_DEFAULT_CONTEXT;
+#else
+static SparkplugContext* _CTX = &_DEFAULT_CONTEXT;
+#endif
+
+// Initialized contexts of each kind. A context using the BasicTag registry would see the tags of
+// every own_tags context as its own, so only one kind can be initialized at a time
+static size_t _REGISTRY_CONTEXTS = 0;
+static size_t _OWN_TAGS_CONTEXTS = 0;
+
+
+static bool _tag_set_available() {
+    return _CTX->own_tags ? _REGISTRY_CONTEXTS == 0 : _OWN_TAGS_CONTEXTS == 0;
+}
+
+static void _count_initialized_context(bool initialized) {
+    size_t* count = _CTX->own_tags ? &_OWN_TAGS_CONTEXTS : &_REGISTRY_CONTEXTS;
+    if (initialized) (*count)++;
+    else if (*count > 0) (*count)--;
+}
+
+static size_t _tags_count() {
+    if (_CTX->own_tags) return _CTX->tags_count;
+    return getTagsCount();
+}
+
+static FunctionalBasicTag* _tag_at(size_t idx) {
+    if (!_CTX->own_tags) return getTagByIdx(idx);
+    if (idx >= _CTX->tags_count) return NULL;
+    return _CTX->tags[idx];
+}
 
 static const char* _bdseq_tag_name = "bdSeq";
 static const int _bdseq_tag_alias = -1000;
@@ -43,27 +232,134 @@ Static declarations
      size_t array_len; // Number of pointers
 } VoidArray;
 
+static bool _pb_encode_metrics_callback(pb_ostream_t *stream, const pb_field_t *field, void *const *arg);
+static bool _pb_encode_single_metric_callback(pb_ostream_t *stream, const pb_field_t *field, void *const *arg);
+
+// Field keys, (field number << 3) | wire type. Field numbers up to 15 fit in one byte
+#define _FIELD_KEY(field_number, wire_type) ((pb_byte_t)(((field_number) << 3) | (wire_type)))
+
+static const pb_byte_t _PAYLOAD_TIMESTAMP_KEY = _FIELD_KEY(Payload_timestamp_tag, PB_WT_VARINT);
+static const pb_byte_t _PAYLOAD_METRICS_KEY = _FIELD_KEY(Payload_metrics_tag, PB_WT_STRING);
+static const pb_byte_t _PAYLOAD_SEQ_KEY = _FIELD_KEY(Payload_seq_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_NAME_KEY = _FIELD_KEY(Payload_Metric_name_tag, PB_WT_STRING);
+static const pb_byte_t _METRIC_ALIAS_KEY = _FIELD_KEY(Payload_Metric_alias_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_TIMESTAMP_KEY = _FIELD_KEY(Payload_Metric_timestamp_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_DATATYPE_KEY = _FIELD_KEY(Payload_Metric_datatype_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_IS_HISTORICAL_KEY = _FIELD_KEY(Payload_Metric_is_historical_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_IS_NULL_KEY = _FIELD_KEY(Payload_Metric_is_null_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_INT_VALUE_KEY = _FIELD_KEY(Payload_Metric_int_value_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_LONG_VALUE_KEY = _FIELD_KEY(Payload_Metric_long_value_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_FLOAT_VALUE_KEY = _FIELD_KEY(Payload_Metric_float_value_tag, PB_WT_32BIT);
+static const pb_byte_t _METRIC_DOUBLE_VALUE_KEY = _FIELD_KEY(Payload_Metric_double_value_tag, PB_WT_64BIT);
+static const pb_byte_t _METRIC_BOOLEAN_VALUE_KEY = _FIELD_KEY(Payload_Metric_boolean_value_tag, PB_WT_VARINT);
+static const pb_byte_t _METRIC_STRING_VALUE_KEY = _FIELD_KEY(Payload_Metric_string_value_tag, PB_WT_STRING);
+// bytes_value is field 16, its key needs a two byte varint
+static const pb_byte_t _METRIC_BYTES_VALUE_KEY[] = {
+    (pb_byte_t)(0x80 | (_FIELD_KEY(Payload_Metric_bytes_value_tag, PB_WT_STRING) & 0x7F)),
+    (pb_byte_t)(_FIELD_KEY(Payload_Metric_bytes_value_tag, PB_WT_STRING) >> 7)
+};
+
 
 /*
 Nanopb encode functions
 */
 
+static bool _encode_to_buffer_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count) {
+    // Same as nanopb's buffer stream, with a callback the metric encoder can recognise
+    uint8_t* dest = (uint8_t*)stream->state;
+    stream->state = dest + count;
+    memcpy(dest, buf, count);
+    return true;
+}
+
+static pb_ostream_t _ostream_from_buffer(uint8_t* buffer, size_t size) {
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    stream.callback = _encode_to_buffer_callback;
+    stream.state = (void*)buffer;
+    stream.max_size = size;
+    return stream;
+}
+
+
+static bool _encode_payload_message(pb_ostream_t *stream, const Payload* payload) {
+    /*
+    Payloads made by this library only use timestamp, metrics and seq, with one of the metric
+    callbacks below. Those are written directly in field order, anything else goes to pb_encode
+    */
+    bool own_metrics = payload->metrics.funcs.encode == NULL
+        || payload->metrics.funcs.encode == _pb_encode_metrics_callback
+        || payload->metrics.funcs.encode == _pb_encode_single_metric_callback;
+    if (!own_metrics || payload->uuid.funcs.encode != NULL || payload->body.funcs.encode != NULL || payload->extensions != NULL) {
+        return pb_encode(stream, Payload_fields, payload);
+    }
+
+    if (payload->has_timestamp) {
+        if (!pb_write(stream, &_PAYLOAD_TIMESTAMP_KEY, 1)) return false;
+        if (!pb_encode_varint(stream, payload->timestamp)) return false;
+    }
+    if (payload->metrics.funcs.encode != NULL) {
+        // The metric callbacks write their own field keys
+        if (!payload->metrics.funcs.encode(stream, NULL, &(payload->metrics.arg))) return false;
+    }
+    if (payload->has_seq) {
+        if (!pb_write(stream, &_PAYLOAD_SEQ_KEY, 1)) return false;
+        if (!pb_encode_varint(stream, payload->seq)) return false;
+    }
+    return true;
+}
+
+
+
+static bool _flush_encode_stream(_EncodeStream* out) {
+    if (out->staged == 0) return true;
+    size_t staged = out->staged;
+    out->staged = 0;
+    return out->write(out->staging, staged, out->ctx);
+}
 
 static bool _encode_to_stream_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count) {
-    StreamFunction userFn = (StreamFunction)stream->state;
-    if (userFn == NULL) return false;
+    _EncodeStream* out = (_EncodeStream*)stream->state;
+    if (out->staging == NULL) return out->write(buf, count, out->ctx);
 
-    userFn((uint8_t*)buf, count);
+    if (out->staged + count > out->staging_size) {
+        if (!_flush_encode_stream(out)) return false;
+        // Nothing to coalesce a large write with, pass it straight through
+        if (count >= out->staging_size) return out->write(buf, count, out->ctx);
+    }
+    memcpy(&(out->staging[out->staged]), buf, count);
+    out->staged += count;
     return true;
 }
 
+static bool _encode_to_stream(Payload* payload, _EncodeStream* out) {
+    if (out->staging == NULL && out->staging_size > 0) {
+        // Without staging memory every pb_write goes to the StreamFunction, still a valid encode
+        out->staging = (uint8_t*)malloc(out->staging_size);
+    }
+    out->staged = 0;
+
+    pb_ostream_t stream;
+    stream.bytes_written = 0;
+    stream.callback = _encode_to_stream_callback;
+    stream.max_size = SIZE_MAX;
+    stream.state = (void*)out;
+#ifndef PB_NO_ERRMSG
+    stream.errmsg = NULL;
+#endif
+    if (!_encode_payload_message(&stream, payload)) {
+        out->staged = 0;
+        return false;
+    }
+    return _flush_encode_stream(out);
+}
 
-static bool _encode_payload(Payload* payload, BufferValue* buffer_ptr, StreamFunction* encodeFn) {
+
+static bool _encode_payload(Payload* payload, BufferValue* buffer_ptr, _EncodeStream* encodeStream) {
     // Encode to either user defined streaming function or to a buffer
     pb_ostream_t stream;
     if (buffer_ptr != NULL) {
-        stream = pb_ostream_from_buffer(buffer_ptr->buffer, buffer_ptr->allocated_length);
-        if (!pb_encode(&stream, Payload_fields, payload)) {
+        stream = _ostream_from_buffer(buffer_ptr->buffer, buffer_ptr->allocated_length);
+        if (!_encode_payload_message(&stream, payload)) {
             // Encode failed
             buffer_ptr->written_length = 0;
             return false;
@@ -71,12 +367,8 @@ static bool _encode_payload(Payload* payload, BufferValue* buffer_ptr, StreamFun
         // Encode successful
         buffer_ptr->written_length = stream.bytes_written;
         return true;
-    } else if (encodeFn != NULL) {
-        stream.bytes_written = 0;
-        stream.callback = _encode_to_stream_callback;
-        stream.max_size = SIZE_MAX;
-        stream.state = (void*)encodeFn;
-        return pb_encode(&stream, Payload_fields, payload);
+    } else if (encodeStream != NULL && encodeStream->write != NULL) {
+        return _encode_to_stream(payload, encodeStream);
     } else {
         // No encoding target was supplied
         return false;
@@ -84,69 +376,215 @@ static bool _encode_payload(Payload* payload, BufferValue* buffer_ptr, StreamFun
 }
 
 
-static bool _pb_encode_string_callback(pb_ostream_t *stream, const pb_field_t *field, void *const *arg) {
-    const char* str = (const char *)(*arg);
-    if (!pb_encode_tag_for_field(stream, field)) return false;
-    if (!pb_encode_string(stream, (const uint8_t *)str, strlen(str))) return false;
+/*
+NBIRTH fragments
+
+Sparkplug requires the NBIRTH to be a single message, so a birth larger than the payload buffer
+can't be split into several payloads. Instead the birth is encoded through a window that only
+keeps the bytes in [offset, offset + buffer length), and the fragments are written into one MQTT
+publish of the total length. The first fragment copies every tag's value next to the birth cache,
+so all fragments carry the same snapshot whatever the tags do in between. Each fragment records
+the metric the window ended in and where it starts, the next one resumes there instead of
+encoding the birth from the start.
+*/
+
+typedef struct {
+    BufferValue* buffer;
+    size_t offset;
+    bool full;  // Encoding stops once the window is filled
+} _EncodeWindow;
+
+
+static bool _encode_to_window_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count) {
+    _EncodeWindow* window = (_EncodeWindow*)stream->state;
+    // pb_write updates bytes_written after the callback returns
+    size_t start = stream->bytes_written;
+    size_t end = start + count;
+    size_t window_end = window->offset + window->buffer->allocated_length;
+
+    if (start >= window_end) {
+        window->full = true;
+        return false;
+    }
+    if (end <= window->offset) return true;
+
+    size_t from = start > window->offset ? start : window->offset;
+    size_t to = end < window_end ? end : window_end;
+    memcpy(&(window->buffer->buffer[from - window->offset]), &buf[from - start], to - from);
+    window->buffer->written_length = to - window->offset;
     return true;
 }
 
 
 /*
-The following 2 functions encode properties to metrics.
-In a future version more value options and functions for handling array of properties will be added
+Scatter-gather output
+
+The payload is described by a list of (pointer, length) entries instead of a single buffer.
+Framing bytes are written to the encode buffer, string and bytes values of at least
+_CTX->iovec_reference_min bytes are referenced in place from the tag's value, so a large blob
+is never copied. Entries that are contiguous in memory are merged.
 */
-static bool _pb_encode_property_names(pb_ostream_t *stream, const pb_field_iter_t *field, void *const *arg) {
-    char **property_key_array = *(char ***)arg;
 
-    for (size_t i = 0; property_key_array[i] != NULL; i++) {
-        if (!pb_encode_tag_for_field(stream, field)) return false;
-        const char* str_arg = property_key_array[i];
-        if (!pb_encode_string(stream, (const uint8_t*)str_arg, strlen(str_arg))) return false;
-    }
+typedef struct {
+    BufferValue* framing;
+    SparkplugIOVecList* list;
+} _IOVecStream;
 
+
+static bool _iovec_append(SparkplugIOVecList* list, const uint8_t* base, size_t length) {
+    if (list->count > 0) {
+        SparkplugIOVec* last = &(list->vecs[list->count - 1]);
+        if ((const uint8_t*)(last->base) + last->length == base) {
+            last->length += length;
+            list->total_length += length;
+            return true;
+        }
+    }
+    if (list->count >= list->allocated_count) return false;
+    list->vecs[list->count].base = (void*)base;
+    list->vecs[list->count].length = length;
+    list->count++;
+    list->total_length += length;
     return true;
 }
 
 
-static bool _pb_encode_property_values(pb_ostream_t *stream, const pb_field_t *field, void *const *arg) {
-    Payload_PropertyValue** property_values = *(Payload_PropertyValue ***)arg;
-    for (size_t i = 0; property_values[i] != NULL; i++) {
-        if (!pb_encode_tag_for_field(stream, field)) return false;
-        
-        if (!pb_encode_submessage(stream, Payload_PropertyValue_fields, property_values[i])) return false;
-        
+static bool _encode_to_iovec_callback(pb_ostream_t *stream, const uint8_t *buf, size_t count) {
+    _IOVecStream* out = (_IOVecStream*)stream->state;
+    BufferValue* framing = out->framing;
+    if (framing->allocated_length - framing->written_length < count) return false;
+
+    uint8_t* dest = &(framing->buffer[framing->written_length]);
+    memcpy(dest, buf, count);
+    framing->written_length += count;
+    return _iovec_append(out->list, dest, count);
+}
+
+
+static bool _encode_value_bytes(pb_ostream_t *stream, const uint8_t* data, size_t length) {
+    // Length prefixed value bytes, referenced instead of copied when writing an iovec list
+    if (stream->callback != _encode_to_iovec_callback || length < _CTX->iovec_reference_min) {
+        return pb_encode_string(stream, data, length);
     }
+    if (!pb_encode_varint(stream, length)) return false;
+    if (!_iovec_append(((_IOVecStream*)stream->state)->list, data, length)) return false;
+    // Keeps the metric length check in step, pb_write is bypassed
+    stream->bytes_written += length;
     return true;
 }
 
 
-static bool _pb_encode_bytes_callback(pb_ostream_t *stream, const pb_field_t *field, void *const *arg) {
-    const BufferValue* buffer_value = (const BufferValue*)(*arg);
-    if (!pb_encode_tag_for_field(stream, field)) return false;
-    if (!pb_encode_string(stream, (const uint8_t *)(buffer_value->buffer), buffer_value->written_length)) return false;
+static bool _encode_payload_to_iovec(Payload* payload, BufferValue* framing, SparkplugIOVecList* list) {
+    _IOVecStream out = {framing, list};
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    stream.callback = _encode_to_iovec_callback;
+    stream.state = (void*)(&out);
+    stream.max_size = SIZE_MAX;
+
+    framing->written_length = 0;
+    list->count = 0;
+    list->total_length = 0;
+    if (!_encode_payload_message(&stream, payload)) {
+        framing->written_length = 0;
+        list->count = 0;
+        list->total_length = 0;
+        return false;
+    }
     return true;
 }
 
 
-static bool _pb_encode_single_metric_callback(pb_ostream_t *stream, const pb_field_t *field, void *const *arg) {
-    Payload_Metric* metric = (Payload_Metric*)(*arg);
-    if (!pb_encode_tag_for_field(stream, field)) return false;
-    if (!pb_encode_submessage(stream, Payload_Metric_fields, metric)) return false;
-    return true;
+/*
+Single pass metric encoding
+
+pb_encode_submessage encodes every metric twice, once to size it and once to write it
+(and the readOnly PropertySet a third time on births). The metrics this library emits only
+ever use a handful of Payload_Metric fields, so their length can be computed directly from
+the field values. The length prefix is written first and the fields follow in a single pass,
+in the same order as the Payload_Metric descriptor, so the output is identical to nanopb's.
+*/
+
+// Flattened view of the Payload_Metric fields used by this library
+typedef struct {
+    const uint8_t* head;  // Pre-encoded name and alias fields, used instead of name/alias when not NULL
+    size_t head_length;
+    const uint8_t* datatype_field;  // Pre-encoded datatype field, used instead of value->datatype when not NULL
+    size_t datatype_field_length;
+    const char* name;  // NULL when the name is not included
+    size_t name_length;
+    bool has_alias;
+    uint64_t alias;
+    uint64_t timestamp;
+    bool is_historical;
+    bool has_read_only;  // readOnly property, only included in births
+    bool read_only;
+    const BasicValue* value;
+} _MetricFields;
+
+// Metric properties field holding PropertySet { keys: ["readOnly"], values: [{ type: Boolean, boolean_value }] }.
+// Everything but the trailing boolean_value byte is constant.
+static const pb_byte_t _READ_ONLY_PROPERTY_PREFIX[] = {
+    0x4A, 0x10,  // properties, length 16
+    0x0A, 0x08, 'r', 'e', 'a', 'd', 'O', 'n', 'l', 'y',  // keys
+    0x12, 0x04,  // values, length 4
+    0x08, 0x0B,  // type Boolean
+    0x38  // boolean_value
+};
+static const size_t _READ_ONLY_PROPERTY_SIZE = sizeof(_READ_ONLY_PROPERTY_PREFIX) + 1;
+
+
+static size_t _varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value > 0x7F) {
+        value >>= 7;
+        size++;
+    }
+    return size;
 }
 
 
-static void _basic_value_to_metric(BasicValue* value, Payload_Metric* metric) {
-    metric->datatype = (uint32_t)(value->datatype);
-    metric->has_datatype = true;
-    metric->has_timestamp = true;
-    metric->timestamp = value->timestamp;
-    if (value->isNull) {
-        metric->has_is_null = true;
-        metric->is_null = true;
-        return;
+static size_t _string_value_length(const BasicValue* value) {
+    if (value->value.stringValue == NULL) return 0;
+    return strlen(value->value.stringValue);
+}
+
+
+static size_t _bytes_value_length(const BasicValue* value) {
+    if (value->value.bytesValue == NULL) return 0;
+    return value->value.bytesValue->written_length;
+}
+
+
+static bool _metric_value_is_null(const BasicValue* value) {
+    // Null values and unsupported datatypes are sent as is_null, which precedes the properties
+    if (value->isNull) return true;
+    switch (value->datatype) {
+        case spInt8:
+        case spInt16:
+        case spInt32:
+        case spUInt8:
+        case spUInt16:
+        case spUInt32:
+        case spInt64:
+        case spDateTime:
+        case spUInt64:
+        case spFloat:
+        case spDouble:
+        case spBoolean:
+        case spText:
+        case spUUID:
+        case spString:
+        case spBytes:
+            return false;
+        default:
+            return true;
     }
+}
+
+
+static size_t _metric_value_size(const BasicValue* value) {
+    // Size of the value oneof (or the is_null field), including the field tag
+    if (value->isNull) return 2;
     switch (value->datatype) {
         case spInt8:
         case spInt16:
@@ -154,237 +592,1188 @@ static void _basic_value_to_metric(BasicValue* value, Payload_Metric* metric) {
         case spUInt8:
         case spUInt16:
         case spUInt32:
-            metric->which_value = Payload_Metric_int_value_tag;
-            metric->value.int_value = value->value.uint32Value;
-            break;
+            return 1 + _varint_size(value->value.uint32Value);
+        case spInt64:
+        case spDateTime:
+        case spUInt64:
+            return 1 + _varint_size(value->value.uint64Value);
+        case spFloat:
+            return 1 + 4;
+        case spDouble:
+            return 1 + 8;
+        case spBoolean:
+            return 1 + 1;
+        case spText:
+        case spUUID:
+        case spString:
+        {
+            size_t length = _string_value_length(value);
+            return 1 + _varint_size(length) + length;
+        }
+        case spBytes:
+        {
+            // field number 16 needs a 2 byte tag
+            size_t length = _bytes_value_length(value);
+            return 2 + _varint_size(length) + length;
+        }
+        default:
+            return 2;
+    }
+}
+
+
+static size_t _metric_fields_size(const _MetricFields* metric) {
+    size_t size = 0;
+    if (metric->head != NULL) {
+        size += metric->head_length;
+    } else {
+        if (metric->name != NULL) size += 1 + _varint_size(metric->name_length) + metric->name_length;
+        if (metric->has_alias) size += 1 + _varint_size(metric->alias);
+    }
+    size += 1 + _varint_size(metric->timestamp);
+    if (metric->datatype_field != NULL) {
+        size += metric->datatype_field_length;
+    } else {
+        size += 1 + _varint_size((uint32_t)(metric->value->datatype));
+    }
+    if (metric->is_historical) size += 2;
+    // is_null (field 7) comes before the properties (field 9), a value after them
+    bool is_null = _metric_value_is_null(metric->value);
+    if (is_null) size += 2;
+    if (metric->has_read_only) size += _READ_ONLY_PROPERTY_SIZE;
+    if (!is_null) size += _metric_value_size(metric->value);
+    return size;
+}
+
+
+static bool _encode_read_only_property(pb_ostream_t *stream, bool read_only) {
+    if (!pb_write(stream, _READ_ONLY_PROPERTY_PREFIX, sizeof(_READ_ONLY_PROPERTY_PREFIX))) return false;
+    return pb_encode_varint(stream, read_only ? 1 : 0);
+}
+
+
+static bool _encode_metric_value(pb_ostream_t *stream, const BasicValue* value) {
+    // The value oneof of a metric that isn't null, see _metric_value_is_null
+    switch (value->datatype) {
+        case spInt8:
+        case spInt16:
+        case spInt32:
+        case spUInt8:
+        case spUInt16:
+        case spUInt32:
+            if (!pb_write(stream, &_METRIC_INT_VALUE_KEY, 1)) return false;
+            return pb_encode_varint(stream, value->value.uint32Value);
         case spInt64:
         case spDateTime:  // Datetime is a uint64
         case spUInt64:
-            metric->which_value = Payload_Metric_long_value_tag;
-            metric->value.long_value = value->value.uint64Value;
-            break;
+            if (!pb_write(stream, &_METRIC_LONG_VALUE_KEY, 1)) return false;
+            return pb_encode_varint(stream, value->value.uint64Value);
         case spFloat:
-            metric->which_value = Payload_Metric_float_value_tag;
-            metric->value.float_value = value->value.floatValue;
-            break;
+            if (!pb_write(stream, &_METRIC_FLOAT_VALUE_KEY, 1)) return false;
+            return pb_encode_fixed32(stream, &(value->value.floatValue));
         case spDouble:
-            metric->which_value = Payload_Metric_double_value_tag;
-            metric->value.double_value = value->value.doubleValue;
-            break;
+            if (!pb_write(stream, &_METRIC_DOUBLE_VALUE_KEY, 1)) return false;
+            return pb_encode_fixed64(stream, &(value->value.doubleValue));
         case spBoolean:
-            metric->which_value = Payload_Metric_boolean_value_tag;
-            metric->value.boolean_value = value->value.boolValue;
-            break;
+            if (!pb_write(stream, &_METRIC_BOOLEAN_VALUE_KEY, 1)) return false;
+            return pb_encode_varint(stream, value->value.boolValue ? 1 : 0);
         case spText:  // Text is a string
         case spUUID: // UUID is a string
         case spString:
-            metric->which_value = Payload_Metric_string_value_tag;
-            metric->value.string_value.funcs.encode = _pb_encode_string_callback;
-            metric->value.string_value.arg = (void*)(value->value.stringValue);
-            break;
+            if (!pb_write(stream, &_METRIC_STRING_VALUE_KEY, 1)) return false;
+            return _encode_value_bytes(stream, (const pb_byte_t*)(value->value.stringValue), _string_value_length(value));
         case spBytes:
-            metric->which_value = Payload_Metric_bytes_value_tag;
-            metric->value.string_value.funcs.encode = _pb_encode_bytes_callback;
-            metric->value.string_value.arg = (void*)(value->value.bytesValue);
-            break;
+            if (!pb_write(stream, _METRIC_BYTES_VALUE_KEY, sizeof(_METRIC_BYTES_VALUE_KEY))) return false;
+            if (value->value.bytesValue == NULL) return pb_encode_varint(stream, 0);
+            return _encode_value_bytes(stream, value->value.bytesValue->buffer, value->value.bytesValue->written_length);
         default:
-            metric->has_is_null = true;
-            metric->is_null = true;
-            break;
+            // Unsupported datatype, sent as is_null instead
+            return false;
     }
 }
 
 
-static bool _pb_encode_metrics_callback(pb_ostream_t *stream, const pb_field_t *field, void *const *arg) {
-    // arg is an array of 2 bools
-    bool *flags = *(bool **)arg; // Recasting and dereferencing
-    bool birth = flags[0];
-    bool is_historical = flags[1];
+/*
+Direct writes
 
-    for (size_t i = 0; i < getTagsCount(); i++) {
-        FunctionalBasicTag* tag_ptr = getTagByIdx(i);
-        if (!birth) {
-            // Skip encode if RBE and value hasn't changed or if the tag alias is in ignored range
-            if (!(tag_ptr->valueChanged) || tag_ptr->alias < -999) continue;
-        }
-        
-        Payload_Metric metric = Payload_Metric_init_zero;
-
-        // Check if historical is required
-        if (is_historical) {
-            metric.has_is_historical = true;
-            metric.is_historical = true;
-        }   
-        
-        bool include_name = birth || tag_ptr->alias < 0;
-        bool include_alias = tag_ptr->alias > -1;
-        // alias included for both data and birth
-        if (include_alias) {
-            // Ignore negative aliases, it's reserved alias for variables like Node Control/Scan Rate, etc
-            metric.has_alias = true;
-            metric.alias = tag_ptr->alias;
-        }
+When the stream is a memory buffer with room for the whole metric, the metric is written
+straight into it instead of through pb_write. The caller has checked the space against the
+computed metric size, only the string and bytes contents are checked again as the tag's
+storage can change between sizing and writing.
+*/
+
+static uint8_t* _write_varint(uint8_t* dest, uint64_t value) {
+    while (value > 0x7F) {
+        *dest++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *dest++ = (uint8_t)value;
+    return dest;
+}
 
-        _basic_value_to_metric(&(tag_ptr->currentValue), &metric);
 
-        if (include_name) {
-            // name includes name only
-            metric.name.funcs.encode = _pb_encode_string_callback;
-            metric.name.arg = (void*)tag_ptr->name;
-        }
+static uint8_t* _write_fixed32(uint8_t* dest, const float* value) {
+    uint32_t bits;
+    memcpy(&bits, value, sizeof(bits));
+    for (size_t i = 0; i < 4; i++) {
+        *dest++ = (uint8_t)(bits >> (8 * i));
+    }
+    return dest;
+}
 
-        if (!birth) {
-            // If it's not a birth payload, it's ready to encode
-            if (!pb_encode_tag_for_field(stream, field)) return false;
-            if (!pb_encode_submessage(stream, Payload_Metric_fields, &metric)) return false;
-            continue;
+
+static uint8_t* _write_fixed64(uint8_t* dest, const double* value) {
+    uint64_t bits;
+    memcpy(&bits, value, sizeof(bits));
+    for (size_t i = 0; i < 8; i++) {
+        *dest++ = (uint8_t)(bits >> (8 * i));
+    }
+    return dest;
+}
+
+
+static uint8_t* _write_length_delimited(uint8_t* dest, const uint8_t* end, const uint8_t* data, size_t length) {
+    if (_varint_size(length) + length > (size_t)(end - dest)) return NULL;
+    dest = _write_varint(dest, length);
+    if (length > 0) memcpy(dest, data, length);
+    return dest + length;
+}
+
+
+static uint8_t* _write_metric_value(uint8_t* dest, const uint8_t* end, const BasicValue* value) {
+    // Same as _encode_metric_value, only for a metric that isn't null
+    switch (value->datatype) {
+        case spInt8:
+        case spInt16:
+        case spInt32:
+        case spUInt8:
+        case spUInt16:
+        case spUInt32:
+            *dest++ = _METRIC_INT_VALUE_KEY;
+            return _write_varint(dest, value->value.uint32Value);
+        case spInt64:
+        case spDateTime:
+        case spUInt64:
+            *dest++ = _METRIC_LONG_VALUE_KEY;
+            return _write_varint(dest, value->value.uint64Value);
+        case spFloat:
+            *dest++ = _METRIC_FLOAT_VALUE_KEY;
+            return _write_fixed32(dest, &(value->value.floatValue));
+        case spDouble:
+            *dest++ = _METRIC_DOUBLE_VALUE_KEY;
+            return _write_fixed64(dest, &(value->value.doubleValue));
+        case spBoolean:
+            *dest++ = _METRIC_BOOLEAN_VALUE_KEY;
+            *dest++ = value->value.boolValue ? 1 : 0;
+            return dest;
+        case spText:
+        case spUUID:
+        case spString:
+            *dest++ = _METRIC_STRING_VALUE_KEY;
+            return _write_length_delimited(dest, end, (const uint8_t*)(value->value.stringValue), _string_value_length(value));
+        case spBytes:
+            *dest++ = _METRIC_BYTES_VALUE_KEY[0];
+            *dest++ = _METRIC_BYTES_VALUE_KEY[1];
+            if (value->value.bytesValue == NULL) return _write_varint(dest, 0);
+            return _write_length_delimited(dest, end, value->value.bytesValue->buffer, value->value.bytesValue->written_length);
+        default:
+            return NULL;
+    }
+}
+
+
+static uint8_t* _write_metric_fields(uint8_t* dest, const uint8_t* end, const _MetricFields* metric) {
+    // Same fields and order as _encode_metric_sized, NULL if a value outgrew its computed size
+    if (metric->head != NULL) {
+        memcpy(dest, metric->head, metric->head_length);
+        dest += metric->head_length;
+    } else {
+        if (metric->name != NULL) {
+            *dest++ = _METRIC_NAME_KEY;
+            dest = _write_length_delimited(dest, end, (const uint8_t*)(metric->name), metric->name_length);
+            if (dest == NULL) return NULL;
         }
+        if (metric->has_alias) {
+            *dest++ = _METRIC_ALIAS_KEY;
+            dest = _write_varint(dest, metric->alias);
+        }
+    }
+    *dest++ = _METRIC_TIMESTAMP_KEY;
+    dest = _write_varint(dest, metric->timestamp);
+    if (metric->datatype_field != NULL) {
+        memcpy(dest, metric->datatype_field, metric->datatype_field_length);
+        dest += metric->datatype_field_length;
+    } else {
+        *dest++ = _METRIC_DATATYPE_KEY;
+        dest = _write_varint(dest, (uint32_t)(metric->value->datatype));
+    }
+    if (metric->is_historical) {
+        *dest++ = _METRIC_IS_HISTORICAL_KEY;
+        *dest++ = 1;
+    }
+    bool is_null = _metric_value_is_null(metric->value);
+    if (is_null) {
+        *dest++ = _METRIC_IS_NULL_KEY;
+        *dest++ = 1;
+    }
+    if (metric->has_read_only) {
+        memcpy(dest, _READ_ONLY_PROPERTY_PREFIX, sizeof(_READ_ONLY_PROPERTY_PREFIX));
+        dest += sizeof(_READ_ONLY_PROPERTY_PREFIX);
+        *dest++ = metric->read_only ? 1 : 0;
+    }
+    return is_null ? dest : _write_metric_value(dest, end, metric->value);
+}
 
-        // Include properties in birth payload
-        Payload_PropertySet tag_properties = Payload_PropertySet_init_zero;
 
-        tag_properties.keys.funcs.encode = _pb_encode_property_names;
-        char* property_key_array[] = {"readOnly", NULL}; 
-        tag_properties.keys.arg = property_key_array;
+static bool _encode_metric_sized(pb_ostream_t *stream, const _MetricFields* metric, size_t metric_size) {
+    // Encodes the metric as a length delimited submessage, writing each field exactly once
+    size_t encoded_size = 1 + _varint_size(metric_size) + metric_size;
+    if (stream->callback == _encode_to_buffer_callback && stream->max_size - stream->bytes_written >= encoded_size) {
+        uint8_t* start = (uint8_t*)stream->state;
+        uint8_t* end = start + encoded_size;
+        uint8_t* dest = start;
+        *dest++ = _PAYLOAD_METRICS_KEY;
+        dest = _write_varint(dest, metric_size);
+        dest = _write_metric_fields(dest, end, metric);
+        // The length prefix is already written, a mismatch would corrupt the payload
+        if (dest != end) return false;
+        stream->state = (void*)end;
+        stream->bytes_written += encoded_size;
+        return true;
+    }
+
+    if (!pb_write(stream, &_PAYLOAD_METRICS_KEY, 1)) return false;
+    if (!pb_encode_varint(stream, metric_size)) return false;
 
-        tag_properties.values.funcs.encode = _pb_encode_property_values;
+    // A sizing stream only counts bytes, the length is already known
+    if (stream->callback == NULL) return pb_write(stream, NULL, metric_size);
 
-        //tag_properties.values.funcs.arg = &read_only;
-        Payload_PropertyValue property_value = Payload_PropertyValue_init_zero;
-        property_value.has_type = true;
-        property_value.type = (uint32_t)11;  // boolean datatype code
-        property_value.which_value = Payload_PropertyValue_boolean_value_tag;
-        property_value.value.boolean_value = !(tag_ptr->remote_writable);
-        Payload_PropertyValue* property_values[] = {&property_value, NULL};
-        tag_properties.values.arg = (void*)property_values;
-        
-        metric.has_properties = true;
-        metric.properties = tag_properties;
+    size_t start = stream->bytes_written;
 
-        // finally encode the metric
-        if (!pb_encode_tag_for_field(stream, field)) return false;
-        if (!pb_encode_submessage(stream, Payload_Metric_fields, &metric)) return false;
+    if (metric->head != NULL) {
+        if (!pb_write(stream, metric->head, metric->head_length)) return false;
+    } else {
+        if (metric->name != NULL) {
+            if (!pb_write(stream, &_METRIC_NAME_KEY, 1)) return false;
+            if (!pb_encode_string(stream, (const pb_byte_t*)(metric->name), metric->name_length)) return false;
+        }
+        if (metric->has_alias) {
+            if (!pb_write(stream, &_METRIC_ALIAS_KEY, 1)) return false;
+            if (!pb_encode_varint(stream, metric->alias)) return false;
+        }
     }
+    if (!pb_write(stream, &_METRIC_TIMESTAMP_KEY, 1)) return false;
+    if (!pb_encode_varint(stream, metric->timestamp)) return false;
+    if (metric->datatype_field != NULL) {
+        if (!pb_write(stream, metric->datatype_field, metric->datatype_field_length)) return false;
+    } else {
+        if (!pb_write(stream, &_METRIC_DATATYPE_KEY, 1)) return false;
+        if (!pb_encode_varint(stream, (uint32_t)(metric->value->datatype))) return false;
+    }
+    if (metric->is_historical) {
+        if (!pb_write(stream, &_METRIC_IS_HISTORICAL_KEY, 1)) return false;
+        if (!pb_encode_varint(stream, 1)) return false;
+    }
+    // Field order as nanopb encodes it, is_null before the properties and the value after them
+    bool is_null = _metric_value_is_null(metric->value);
+    if (is_null) {
+        if (!pb_write(stream, &_METRIC_IS_NULL_KEY, 1)) return false;
+        if (!pb_encode_varint(stream, 1)) return false;
+    }
+    if (metric->has_read_only) {
+        if (!_encode_read_only_property(stream, metric->read_only)) return false;
+    }
+    if (!is_null && !_encode_metric_value(stream, metric->value)) return false;
 
-    return true;
+    // The length prefix is already written, a mismatch would corrupt the payload
+    return (stream->bytes_written - start) == metric_size;
+}
+
+
+static bool _encode_metric(pb_ostream_t *stream, const _MetricFields* metric) {
+    return _encode_metric_sized(stream, metric, _metric_fields_size(metric));
 }
 
 
 /*
-Nanopb decode functions
+Birth cache
+
+The name, alias and datatype fields of a metric never change between births, so they are encoded
+once per tag and copied into every NBIRTH and NDATA. The cache is checked against the tag registry
+at the start of each birth and rebuilt when tags were added, removed or re-aliased. An NDATA only
+uses the entries of the tags it sends, each is checked against its tag before use.
+
+The NDATA head is the tail of the birth head, the alias field (or the name for tags without an
+alias), so it takes no extra space. The fields stay in Payload_Metric order, the timestamp is
+written between the head and the datatype field.
 */
 
-static bool _default_validate_scan_rate(BasicValue* newValue) {
-    if (newValue == NULL) return false;
-    if (newValue->isNull) return false;
-    if (newValue->value.uint32Value < _SCAN_RATE_MIN || newValue->value.uint32Value > _SCAN_RATE_MAX) return false;
-    return true;
-}
 
 
-static int _on_decode_metric_default(BasicValue* valueReceived, FunctionalBasicTag* matchedTag) {
-    if (writeBasicTag(matchedTag, valueReceived)) return 0;
-    return 1;
+static size_t _birth_head_size(FunctionalBasicTag* tag_ptr) {
+    size_t name_length = strlen(tag_ptr->name);
+    size_t size = 1 + _varint_size(name_length) + name_length;
+    if (tag_ptr->alias > -1) size += 1 + _varint_size((uint64_t)(tag_ptr->alias));
+    return size;
 }
 
 
-static bool _decode_string_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
-    size_t str_length = stream->bytes_left;
-    // Make Hard limit for incoming string length
-    if (str_length > _INCOMING_STRING_MAX_LEN) return false;
-    uint8_t* char_buf = malloc(str_length + 1); // memory leak potential
-    if (char_buf == NULL) return false;
-    char_buf[str_length] = '\0';
-    if (!pb_read(stream, char_buf, str_length)) {
-        free(char_buf);
-        return false;
+static bool _birth_cache_valid() {
+    if (_CTX->birth_cache.entries == NULL || _CTX->birth_cache.count != _tags_count()) return false;
+    for (size_t i = 0; i < _CTX->birth_cache.count; i++) {
+        _BirthCacheEntry* entry = &(_CTX->birth_cache.entries[i]);
+        FunctionalBasicTag* tag_ptr = _tag_at(i);
+        if (entry->tag != tag_ptr || entry->name != tag_ptr->name || entry->alias != tag_ptr->alias) return false;
     }
-    *arg = char_buf;
     return true;
 }
 
 
-static bool _decode_buffer_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
-    /*
-    
-    */
-    size_t bytes_length = stream->bytes_left;
-    // Make Hard limit for incoming string length
-    if (bytes_length > _INCOMING_BUFFER_MAX_LEN) return false;
+static const _BirthCacheEntry* _birth_cache_entry(size_t idx, FunctionalBasicTag* tag_ptr) {
+    // The entry of a tag if it is still current, checks one tag rather than the whole registry
+    if (idx >= _CTX->birth_cache.count || _CTX->birth_cache.count != _tags_count()) return NULL;
+    const _BirthCacheEntry* entry = &(_CTX->birth_cache.entries[idx]);
+    if (entry->tag != tag_ptr || entry->name != tag_ptr->name || entry->alias != tag_ptr->alias) return NULL;
+    return entry;
+}
 
-    BasicValue* value_ptr = (BasicValue*)(*arg);
-    // Include an extra byte for null terminator, incase the buffer later needs to be recast as char*
-    if (!allocateBufferValue(value_ptr, bytes_length + 1)) return false;  // memory leak potential
-    value_ptr->value.bytesValue->allocated_length = bytes_length + 1;
-    // preset the null char, it affects nothing if the value is bufferval, but ready to be recast as char*
-    value_ptr->value.bytesValue->buffer[bytes_length] = '\0';
-    if (!pb_read(stream, value_ptr->value.bytesValue->buffer, bytes_length)) {
-        deallocateBufferValue(value_ptr);
-        return false;
-    }
 
-    value_ptr->value.bytesValue->written_length = bytes_length;
-    return true;
+static void _tag_to_metric_fields(FunctionalBasicTag* tag_ptr, const _BirthCacheEntry* cached, bool birth, bool is_historical, _MetricFields* metric) {
+    // Ignore negative aliases, it's reserved alias for variables like Node Control/Scan Rate, etc
+    metric->has_alias = tag_ptr->alias > -1;
+    metric->alias = metric->has_alias ? (uint64_t)(tag_ptr->alias) : 0;
+    metric->datatype_field = NULL;
+    metric->datatype_field_length = 0;
+    if (cached != NULL) {
+        size_t start = birth ? cached->offset : cached->data_offset;
+        metric->head = &(_CTX->birth_cache.bytes[start]);
+        metric->head_length = cached->offset + cached->length - start;
+        metric->name = NULL;
+        metric->name_length = 0;
+        if (cached->datatype == tag_ptr->currentValue.datatype) {
+            metric->datatype_field = cached->datatype_field;
+            metric->datatype_field_length = cached->datatype_field_length;
+        }
+    } else {
+        bool include_name = birth || tag_ptr->alias < 0;
+        metric->head = NULL;
+        metric->head_length = 0;
+        metric->name = include_name ? tag_ptr->name : NULL;
+        metric->name_length = include_name ? strlen(tag_ptr->name) : 0;
+    }
+    metric->timestamp = tag_ptr->currentValue.timestamp;
+    metric->is_historical = is_historical;
+    // Include properties in birth payload
+    metric->has_read_only = birth;
+    metric->read_only = !(tag_ptr->remote_writable);
+    metric->value = &(tag_ptr->currentValue);
 }
 
 
-static bool _decode_metric_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
-    Payload_Metric metric = Payload_Metric_init_zero;
-    
-    metric.name.funcs.decode = _decode_string_callback;
-    metric.name.arg = NULL;
+/*
+Tag index
+
+Open addressing hash tables from metric name and alias to registry index, so an NCMD metric or
+a special tag is found without walking the registry. The index is built with the birth cache and
+dropped when tags are added or removed, or when the registry size changed as tags of the BasicTag
+registry are created outside this library. A lookup without an index builds it first. A registry
+tag deleted and another created keeps the size, so a miss that probed a moved tag, or finds a
+different last tag than the build did, rebuilds the index once and looks again. New registry tags
+are expected at the end of the registry. Tags renamed or re-aliased are found under their new key
+after the next birth, which rebuilds the index with the birth cache.
+*/
 
-    // set decode in case the metric is string or bytes
-    metric.value.bytes_value.funcs.decode = _decode_buffer_callback;
-    BasicValue metric_value;
-    metric_value.value.bytesValue = NULL;
 
-    metric.value.bytes_value.arg = &metric_value;
 
-    if (!pb_decode(stream, Payload_Metric_fields, &metric)) {
-        if (metric.name.arg != NULL) free(metric.name.arg);
-        if (metric_value.value.bytesValue != NULL) deallocateBufferValue(&metric_value);
-        return false;
+static uint32_t _hash_name(const uint8_t* name, size_t length) {
+    // FNV-1a, names are hashed by length so views into a payload need no terminator
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    //if (!_sp_datatype_valid())
 
-    FunctionalBasicTag* matchedTag = NULL;
-    if (metric.has_alias) {
-        // Get tag by alias
-        matchedTag = getTagByAlias((int)metric.alias);
+static uint32_t _hash_alias(int alias) {
+    uint32_t hash = (uint32_t)alias;
+    hash ^= hash >> 16;
+    hash *= 0x7feb352du;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68bu;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+
+static bool _tag_name_equals(FunctionalBasicTag* tag_ptr, const uint8_t* name, size_t length) {
+    // Lengths first, so the tag name is never read past its terminator
+    return strlen(tag_ptr->name) == length && memcmp(tag_ptr->name, name, length) == 0;
+}
+
+
+static void _clear_tag_index() {
+    if (_CTX->tag_index.names != NULL) free(_CTX->tag_index.names);
+    if (_CTX->tag_index.aliases != NULL) free(_CTX->tag_index.aliases);
+    if (_CTX->tag_index.tags != NULL) free(_CTX->tag_index.tags);
+    _CTX->tag_index.names = NULL;
+    _CTX->tag_index.aliases = NULL;
+    _CTX->tag_index.tags = NULL;
+    _CTX->tag_index.last_name = NULL;
+    _CTX->tag_index.slots = 0;
+    _CTX->tag_index.count = 0;
+    _CTX->tag_index.valid = false;
+}
+
+
+static bool _build_tag_index() {
+    size_t count = _tags_count();
+    if (count >= UINT32_MAX / 2) return false;
+    size_t slots = 8;
+    while (slots < count * 2) slots <<= 1;
+
+    if (slots != _CTX->tag_index.slots) {
+        _clear_tag_index();
+        _CTX->tag_index.names = (uint32_t*)malloc(slots * sizeof(uint32_t));
+        _CTX->tag_index.aliases = (uint32_t*)malloc(slots * sizeof(uint32_t));
+        _CTX->tag_index.tags = (FunctionalBasicTag**)malloc(slots * sizeof(FunctionalBasicTag*));
+        if (_CTX->tag_index.names == NULL || _CTX->tag_index.aliases == NULL || _CTX->tag_index.tags == NULL) {
+            _clear_tag_index();
+            return false;
+        }
+        _CTX->tag_index.slots = slots;
+    }
+    memset(_CTX->tag_index.names, 0, slots * sizeof(uint32_t));
+    memset(_CTX->tag_index.aliases, 0, slots * sizeof(uint32_t));
+
+    // Inserted in registry order, a duplicated key resolves to the first tag like the registry lookup
+    size_t mask = slots - 1;
+    for (size_t i = 0; i < count; i++) {
+        FunctionalBasicTag* tag_ptr = _tag_at(i);
+        _CTX->tag_index.tags[i] = tag_ptr;
+        if (tag_ptr == NULL) continue;
+        size_t slot = _hash_name((const uint8_t*)(tag_ptr->name), strlen(tag_ptr->name)) & mask;
+        while (_CTX->tag_index.names[slot] != 0) slot = (slot + 1) & mask;
+        _CTX->tag_index.names[slot] = (uint32_t)(i + 1);
+
+        // Tags without an alias would all share one probe run
+        if (tag_ptr->alias < 0) continue;
+        slot = _hash_alias(tag_ptr->alias) & mask;
+        while (_CTX->tag_index.aliases[slot] != 0) slot = (slot + 1) & mask;
+        _CTX->tag_index.aliases[slot] = (uint32_t)(i + 1);
+    }
+    _CTX->tag_index.last_name = count > 0 && _CTX->tag_index.tags[count - 1] != NULL ? _CTX->tag_index.tags[count - 1]->name : NULL;
+    _CTX->tag_index.count = count;
+    _CTX->tag_index.valid = true;
+    return true;
+}
+
+
+static bool _tag_index_current() {
+    return _CTX->tag_index.names != NULL && _CTX->tag_index.valid && _CTX->tag_index.count == _tags_count();
+}
+
+
+static bool _tag_index_usable() {
+    // Only false if the index can't be allocated
+    return _tag_index_current() || _build_tag_index();
+}
+
+
+static bool _tag_index_moved(size_t index) {
+    // Own tags can't change without the index being dropped
+    return !_CTX->own_tags && _tag_at(index) != _CTX->tag_index.tags[index];
+}
+
+
+static bool _tag_index_missed() {
+    // A registry tag created since the build is the last tag
+    size_t count = _CTX->tag_index.count;
+    if (_CTX->own_tags || count == 0) return false;
+    FunctionalBasicTag* tag_ptr = _tag_at(count - 1);
+    if (tag_ptr != _CTX->tag_index.tags[count - 1]) return true;
+    // The same address reused by a new tag
+    return tag_ptr != NULL && tag_ptr->name != _CTX->tag_index.last_name;
+}
+
+
+static FunctionalBasicTag* _find_indexed_name(const uint8_t* name, size_t length, bool* stale) {
+    size_t mask = _CTX->tag_index.slots - 1;
+    size_t slot = _hash_name(name, length) & mask;
+    for (; _CTX->tag_index.names[slot] != 0; slot = (slot + 1) & mask) {
+        size_t index = _CTX->tag_index.names[slot] - 1;
+        FunctionalBasicTag* tag_ptr = _tag_at(index);
+        if (tag_ptr != NULL && _tag_name_equals(tag_ptr, name, length)) return tag_ptr;
+        if (_tag_index_moved(index)) *stale = true;
+    }
+    if (_tag_index_missed()) *stale = true;
+    return NULL;
+}
+
+
+static FunctionalBasicTag* _find_indexed_alias(int alias, bool* stale) {
+    size_t mask = _CTX->tag_index.slots - 1;
+    size_t slot = _hash_alias(alias) & mask;
+    for (; _CTX->tag_index.aliases[slot] != 0; slot = (slot + 1) & mask) {
+        size_t index = _CTX->tag_index.aliases[slot] - 1;
+        FunctionalBasicTag* tag_ptr = _tag_at(index);
+        if (tag_ptr != NULL && tag_ptr->alias == alias) return tag_ptr;
+        if (_tag_index_moved(index)) *stale = true;
+    }
+    if (_tag_index_missed()) *stale = true;
+    return NULL;
+}
+
+
+static FunctionalBasicTag* _get_tag_by_name_view(const uint8_t* name, size_t length) {
+    // A name with an embedded NUL can't be a tag name
+    if (length > 0 && memchr(name, '\0', length) != NULL) return NULL;
+    if (_tag_index_usable()) {
+        bool stale = false;
+        FunctionalBasicTag* tag_ptr = _find_indexed_name(name, length, &stale);
+        if (tag_ptr != NULL || !stale) return tag_ptr;
+        // Registry tags deleted and created since the build
+        if (_build_tag_index()) return _find_indexed_name(name, length, &stale);
+    }
+    // No memory for the index
+    size_t count = _tags_count();
+    for (size_t i = 0; i < count; i++) {
+        FunctionalBasicTag* tag_ptr = _tag_at(i);
+        if (tag_ptr != NULL && _tag_name_equals(tag_ptr, name, length)) return tag_ptr;
+    }
+    return NULL;
+}
+
+
+FunctionalBasicTag* findSparkplugTagByName(const char* name) {
+    if (name == NULL) return NULL;
+    return _get_tag_by_name_view((const uint8_t*)name, strlen(name));
+}
+
+
+FunctionalBasicTag* findSparkplugTagByAlias(int alias) {
+    // Negative aliases aren't indexed, only searched for by local callers
+    if (alias >= 0 && _tag_index_usable()) {
+        bool stale = false;
+        FunctionalBasicTag* tag_ptr = _find_indexed_alias(alias, &stale);
+        if (tag_ptr != NULL || !stale) return tag_ptr;
+        // Registry tags deleted and created since the build
+        if (_build_tag_index()) return _find_indexed_alias(alias, &stale);
+    }
+    // Not indexed, or no memory for the index
+    if (!_CTX->own_tags) return getTagByAlias(alias);
+    for (size_t i = 0; i < _CTX->tags_count; i++) {
+        if (_CTX->tags[i]->alias == alias) return _CTX->tags[i];
+    }
+    return NULL;
+}
+
+
+/*
+Changed tag list
+
+readSparkplugTags records the index of every tag that changed during the scan, so an NDATA
+only visits those tags instead of walking the whole registry. The list is used by the next
+NDATA and dropped once that payload is made, NDATA payloads made without a preceding
+readSparkplugTags fall back to checking every tag.
+*/
+
+
+
+static bool _dirty_tags_usable() {
+    return _CTX->dirty_tags.valid && _CTX->dirty_tags.tags_count == _tags_count();
+}
+
+
+/*
+Split NDATA
+
+In split mode an NDATA whose metrics don't fit in the buffer is sent as several payloads.
+Each part holds as many metrics as fit and the position of the first metric left out is kept
+here, the next part continues from it. A new scan starts a new NDATA.
+*/
+
+
+
+typedef struct {
+    bool birth;
+    bool is_historical;
+    bool split;  // Stop at the first metric that doesn't fit instead of failing, see _CTX->ndata_split
+    size_t reserved;  // Bytes kept free after the metrics for the trailing seq field
+} _MetricsEncodeArgs;
+
+
+static bool _pb_encode_metrics_callback(pb_ostream_t *stream, const pb_field_t *field, void *const *arg) {
+    const _MetricsEncodeArgs* args = (const _MetricsEncodeArgs*)(*arg);
+    bool birth = args->birth;
+    _MetricFields metric;
+
+    // Only visit the tags that changed in the last scan when the list is available
+    bool use_dirty_tags = !birth && _dirty_tags_usable();
+    size_t count = use_dirty_tags ? _CTX->dirty_tags.count : _tags_count();
+    size_t first = args->split ? _CTX->ndata_split.next : 0;
+    bool encoded_any = false;
+
+    // Births copy the pre-encoded name and alias fields from the cache when it can be built,
+    // NDATA payloads use the entries still current from the last build
+    bool use_cache = birth ? buildSparkplugBirthCache() : _CTX->birth_cache.count == _tags_count();
+
+    for (size_t k = first; k < count; k++) {
+        size_t i = use_dirty_tags ? _CTX->dirty_tags.indexes[k] : k;
+        FunctionalBasicTag* tag_ptr = _tag_at(i);
+        if (tag_ptr == NULL) continue;
+        if (!birth) {
+            // Skip encode if RBE and value hasn't changed or if the tag alias is in ignored range
+            if (!(tag_ptr->valueChanged) || tag_ptr->alias < -999) continue;
+        }
+
+        const _BirthCacheEntry* cached = NULL;
+        if (use_cache) cached = birth ? &(_CTX->birth_cache.entries[i]) : _birth_cache_entry(i, tag_ptr);
+        _tag_to_metric_fields(tag_ptr, cached, birth, args->is_historical, &metric);
+        size_t metric_size = _metric_fields_size(&metric);
+
+        if (args->split) {
+            size_t encoded_size = 1 + _varint_size(metric_size) + metric_size;
+            if (stream->bytes_written + encoded_size + args->reserved > stream->max_size) {
+                // A single metric larger than the buffer can never be sent
+                if (!encoded_any) return false;
+                _CTX->ndata_split.next = k;
+                _CTX->ndata_split.pending = true;
+                return true;
+            }
+        }
+        if (!_encode_metric_sized(stream, &metric, metric_size)) return false;
+        encoded_any = true;
+    }
+
+    if (args->split) {
+        _CTX->ndata_split.next = 0;
+        _CTX->ndata_split.pending = false;
+    }
+    return true;
+}
+
+
+static bool _pb_encode_single_metric_callback(pb_ostream_t *stream, const pb_field_t *field, void *const *arg) {
+    const _MetricFields* metric = (const _MetricFields*)(*arg);
+    return _encode_metric(stream, metric);
+}
+
+
+/*
+Nanopb decode functions
+*/
+
+static bool _default_validate_scan_rate(BasicValue* newValue) {
+    if (newValue == NULL) return false;
+    if (newValue->isNull) return false;
+    if (newValue->value.uint32Value < _SCAN_RATE_MIN || newValue->value.uint32Value > _SCAN_RATE_MAX) return false;
+    return true;
+}
+
+
+static int _on_decode_metric_default(BasicValue* valueReceived, FunctionalBasicTag* matchedTag) {
+    if (writeBasicTag(matchedTag, valueReceived)) return 0;
+    return 1;
+}
+
+
+/*
+Tag command callbacks
+
+Per-tag NCMD handlers, kept in an open addressing table keyed by the tag's address so a decoded
+metric finds its handler in one probe however many tags have one. The table holds the
+SparkplugTagData of every tag given a handler or a scan class, a removed handler leaves its entry
+with a NULL callback until the table grows. Metrics of tags without a handler go to the callback
+given to processNCMD, or are written with writeBasicTag.
+*/
+
+
+
+static size_t _hash_tag_pointer(const FunctionalBasicTag* tag_ptr) {
+    uint64_t hash = (uint64_t)(uintptr_t)tag_ptr;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (size_t)hash;
+}
+
+
+static SparkplugTagData* _tag_data_slot(SparkplugTagData* entries, size_t slots, const FunctionalBasicTag* tag_ptr) {
+    // The entry of the tag, or the empty slot where it goes
+    size_t mask = slots - 1;
+    size_t slot = _hash_tag_pointer(tag_ptr) & mask;
+    while (entries[slot].tag != NULL && entries[slot].tag != tag_ptr) slot = (slot + 1) & mask;
+    return &(entries[slot]);
+}
+
+
+static bool _grow_tag_commands() {
+    size_t slots = _CTX->tag_commands.slots == 0 ? 16 : _CTX->tag_commands.slots * 2;
+    SparkplugTagData* entries = (SparkplugTagData*)calloc(slots, sizeof(SparkplugTagData));
+    if (entries == NULL) return false;
+    size_t used = 0;
+    // Removed handlers are dropped here
+    for (size_t i = 0; i < _CTX->tag_commands.slots; i++) {
+        SparkplugTagData* entry = &(_CTX->tag_commands.entries[i]);
+        if (entry->tag == NULL || (entry->on_cmd_callback == NULL && entry->scan_class == 0)) continue;
+        *_tag_data_slot(entries, slots, entry->tag) = *entry;
+        used++;
+    }
+    if (_CTX->tag_commands.entries != NULL) free(_CTX->tag_commands.entries);
+    _CTX->tag_commands.entries = entries;
+    _CTX->tag_commands.slots = slots;
+    _CTX->tag_commands.used = used;
+    return true;
+}
+
+
+static SparkplugTagData* _tag_data(FunctionalBasicTag* tag_ptr, bool add) {
+    /* The tag's entry, NULL if it has none and add isn't set */
+    if (_CTX->tag_commands.used > 0) {
+        SparkplugTagData* entry = _tag_data_slot(_CTX->tag_commands.entries, _CTX->tag_commands.slots, tag_ptr);
+        if (entry->tag == tag_ptr) return entry;
+    }
+    if (!add) return NULL;
+    // At most half full so a probe ends quickly
+    if ((_CTX->tag_commands.used + 1) * 2 > _CTX->tag_commands.slots && !_grow_tag_commands()) return NULL;
+    SparkplugTagData* entry = _tag_data_slot(_CTX->tag_commands.entries, _CTX->tag_commands.slots, tag_ptr);
+    entry->tag = tag_ptr;
+    entry->on_cmd_callback = NULL;
+    entry->scan_class = 0;
+    _CTX->tag_commands.used++;
+    return entry;
+}
+
+
+static DecodeMetricCallback _tag_command_callback(const FunctionalBasicTag* tag_ptr) {
+    if (_CTX->tag_commands.used == 0) return NULL;
+    return _tag_data_slot(_CTX->tag_commands.entries, _CTX->tag_commands.slots, tag_ptr)->on_cmd_callback;
+}
+
+
+static int _dispatch_command(BasicValue* valueReceived, FunctionalBasicTag* matchedTag, DecodeMetricCallback callback) {
+    DecodeMetricCallback handler = _tag_command_callback(matchedTag);
+    if (handler == NULL) handler = callback;
+    if (handler == NULL) return _on_decode_metric_default(valueReceived, matchedTag);
+    return handler(valueReceived, matchedTag);
+}
+
+
+static void _clear_tag_commands() {
+    if (_CTX->tag_commands.entries != NULL) free(_CTX->tag_commands.entries);
+    _CTX->tag_commands.entries = NULL;
+    _CTX->tag_commands.slots = 0;
+    _CTX->tag_commands.used = 0;
+}
+
+
+/*
+NCMD decode memory
+
+Metric names and string/bytes values are decoded into a scratch arena when one is set, so an
+NCMD is handled without heap calls. Everything a metric allocated is dropped once it has been
+dispatched, the arena only has to hold the largest single metric. Without an arena the heap is used.
+*/
+
+
+static const uintptr_t _DECODE_ARENA_ALIGN = 8;
+
+
+static void* _decode_alloc(size_t size) {
+    if (_CTX->decode_arena.buffer == NULL) return malloc(size);
+
+    uintptr_t base = (uintptr_t)(_CTX->decode_arena.buffer);
+    uintptr_t aligned = (base + _CTX->decode_arena.used + _DECODE_ARENA_ALIGN - 1) & ~(_DECODE_ARENA_ALIGN - 1);
+    size_t start = (size_t)(aligned - base);
+    if (start > _CTX->decode_arena.size || size > _CTX->decode_arena.size - start) return NULL;
+    _CTX->decode_arena.used = start + size;
+    return &(_CTX->decode_arena.buffer[start]);
+}
+
+
+static void _decode_free(void* ptr) {
+    // Arena memory is released all at once after the metric
+    if (ptr != NULL && _CTX->decode_arena.buffer == NULL) free(ptr);
+}
+
+
+static bool _decode_alloc_buffer_value(BasicValue* value, size_t size) {
+    BufferValue* buffer_value = (BufferValue*)_decode_alloc(sizeof(BufferValue));
+    if (buffer_value == NULL) return false;
+    buffer_value->buffer = (uint8_t*)_decode_alloc(size);
+    if (buffer_value->buffer == NULL) {
+        _decode_free(buffer_value);
+        return false;
+    }
+    buffer_value->allocated_length = size;
+    buffer_value->written_length = 0;
+    value->value.bytesValue = buffer_value;
+    return true;
+}
+
+
+static void _decode_free_buffer_value(BasicValue* value) {
+    if (value->value.bytesValue == NULL) return;
+    _decode_free(value->value.bytesValue->buffer);
+    _decode_free(value->value.bytesValue);
+    value->value.bytesValue = NULL;
+}
+
+
+static bool _decode_string_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
+    size_t str_length = stream->bytes_left;
+    // Make Hard limit for incoming string length
+    if (str_length > _INCOMING_STRING_MAX_LEN) return false;
+    uint8_t* char_buf = (uint8_t*)_decode_alloc(str_length + 1);
+    if (char_buf == NULL) return false;
+    char_buf[str_length] = '\0';
+    if (!pb_read(stream, char_buf, str_length)) {
+        _decode_free(char_buf);
+        return false;
+    }
+    // A name with an embedded NUL can't be a tag name, left unset so it matches no tag
+    if (memchr(char_buf, '\0', str_length) != NULL) {
+        _decode_free(char_buf);
+        return true;
+    }
+    *arg = char_buf;
+    return true;
+}
+
+
+static bool _decode_buffer_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
+    /*
+    
+    */
+    size_t bytes_length = stream->bytes_left;
+    // Make Hard limit for incoming string length
+    if (bytes_length > _INCOMING_BUFFER_MAX_LEN) return false;
+
+    BasicValue* value_ptr = (BasicValue*)(*arg);
+    // Include an extra byte for null terminator, incase the buffer later needs to be recast as char*
+    if (!_decode_alloc_buffer_value(value_ptr, bytes_length + 1)) return false;
+    // preset the null char, it affects nothing if the value is bufferval, but ready to be recast as char*
+    value_ptr->value.bytesValue->buffer[bytes_length] = '\0';
+    if (!pb_read(stream, value_ptr->value.bytesValue->buffer, bytes_length)) {
+        _decode_free_buffer_value(value_ptr);
+        return false;
+    }
+
+    value_ptr->value.bytesValue->written_length = bytes_length;
+    return true;
+}
+
+
+/*
+NCMD views
+
+In view mode names and string/bytes values are not copied out of the NCMD, they are read as
+pointers into the input buffer. Names are matched by length and contents, bytes values reach
+the DecodeMetricCallback as a BufferValue over the input. The default writer and per-tag
+handlers get a NUL terminated string, so string values are copied for them, one at a time.
+*/
+
+typedef struct {
+    DecodeMetricCallback callback;
+    bool views;
+    _NCMDStage* stage;  // Metrics are staged here instead of written, NULL writes them as decoded
+} _DecodeArgs;
+
+typedef struct {
+    const uint8_t* data;
+    size_t length;
+} _DecodeView;
+
+
+static bool _decode_from_buffer_callback(pb_istream_t *stream, uint8_t *buf, size_t count) {
+    // Same as nanopb's buffer stream, with a callback the view decoders can recognise
+    const uint8_t* source = (const uint8_t*)stream->state;
+    stream->state = (void*)(source + count);
+    if (buf != NULL) memcpy(buf, source, count);
+    return true;
+}
+
+
+static pb_istream_t _istream_from_buffer(const uint8_t* buffer, size_t size) {
+    pb_istream_t stream;
+    stream.callback = _decode_from_buffer_callback;
+    stream.state = (void*)buffer;
+    stream.bytes_left = size;
+#ifndef PB_NO_ERRMSG
+    stream.errmsg = NULL;
+#endif
+    return stream;
+}
+
+
+static const uint8_t* _decode_view(pb_istream_t *stream, size_t length) {
+    // The next length bytes of the input, consumed without copying
+    if (stream->callback != _decode_from_buffer_callback || length > stream->bytes_left) return NULL;
+    const uint8_t* view = (const uint8_t*)stream->state;
+    stream->state = (void*)(view + length);
+    stream->bytes_left -= length;
+    return view;
+}
+
+
+static bool _decode_name_view_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
+    _DecodeView* view = (_DecodeView*)(*arg);
+    view->length = stream->bytes_left;
+    view->data = _decode_view(stream, view->length);
+    return view->data != NULL;
+}
+
+
+static bool _decode_buffer_view_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
+    BufferValue* view = (BufferValue*)(*arg);
+    size_t length = stream->bytes_left;
+    view->buffer = (uint8_t*)_decode_view(stream, length);
+    view->allocated_length = length;
+    view->written_length = length;
+    return view->buffer != NULL;
+}
+
+
+/*
+Staged NCMD
+
+A staged NCMD is applied all or nothing. Every metric is decoded and checked first: the tag must
+exist, be remote writable and match the datatype, and the default writer also runs the tag's
+validateWrite. Any metric failing a check rejects the whole NCMD before a tag is written. The
+staged writes are then committed in order in a single pass. Values stay views into the input,
+strings are copied into the decode arena one at a time as they are written.
+*/
+
+
+
+
+static void _reset_ncmd_stage(_NCMDStage* stage, bool copy_values) {
+    stage->count = 0;
+    stage->bytes_used = 0;
+    stage->copy_values = copy_values;
+}
+
+
+static bool _stage_value_copy(_NCMDStage* stage, const BufferValue* view, size_t* offset) {
+    size_t length = view->written_length;
+    if (length > SIZE_MAX - stage->bytes_used) return false;
+    if (stage->bytes_used + length > stage->bytes_allocated) {
+        size_t allocated = stage->bytes_allocated == 0 ? 256 : stage->bytes_allocated;
+        while (allocated < stage->bytes_used + length) allocated *= 2;
+        uint8_t* bytes = (uint8_t*)realloc(stage->bytes, allocated);
+        if (bytes == NULL) return false;
+        stage->bytes = bytes;
+        stage->bytes_allocated = allocated;
+    }
+    if (length > 0) memcpy(&(stage->bytes[stage->bytes_used]), view->buffer, length);
+    *offset = stage->bytes_used;
+    stage->bytes_used += length;
+    return true;
+}
+
+
+static bool _stage_metric(_NCMDStage* stage, FunctionalBasicTag* tag_ptr, BasicValue* value, const BufferValue* view, bool validate) {
+    if (validate && tag_ptr->validateWrite != NULL && !(tag_ptr->validateWrite(value))) return false;
+    if (stage->count == stage->allocated) {
+        size_t allocated = stage->allocated == 0 ? 16 : stage->allocated * 2;
+        _StagedWrite* writes = (_StagedWrite*)realloc(stage->writes, allocated * sizeof(_StagedWrite));
+        if (writes == NULL) return false;
+        stage->writes = writes;
+        stage->allocated = allocated;
+    }
+    _StagedWrite* write = &(stage->writes[stage->count]);
+    write->tag = tag_ptr;
+    write->value = *value;
+    write->view = *view;
+    write->view_offset = 0;
+    if (stage->copy_values && view->buffer != NULL && !_stage_value_copy(stage, view, &(write->view_offset))) return false;
+    stage->count++;
+    return true;
+}
+
+
+static bool _commit_staged_write(_NCMDStage* stage, _StagedWrite* write, DecodeMetricCallback callback) {
+    BasicValue* value = &(write->value);
+    if (stage->copy_values && write->view.buffer != NULL) write->view.buffer = &(stage->bytes[write->view_offset]);
+    bool has_view = !(value->isNull) && write->view.buffer != NULL;
+    char* copy = NULL;
+    switch (value->datatype) {
+        case spText:
+        case spUUID:
+        case spString:
+            if (!has_view) break;
+            // NUL terminated for every handler, as processNCMD
+            copy = (char*)_decode_alloc(write->view.written_length + 1);
+            if (copy == NULL) return false;
+            memcpy(copy, write->view.buffer, write->view.written_length);
+            copy[write->view.written_length] = '\0';
+            value->value.stringValue = copy;
+            break;
+        case spBytes:
+            if (has_view) value->value.bytesValue = &(write->view);
+            break;
+        default:
+            break;
+    }
+    int status = _dispatch_command(value, write->tag, callback);
+    _decode_free(copy);
+    return status == 0;
+}
+
+
+static bool _commit_ncmd_stage(_NCMDStage* stage, DecodeMetricCallback callback, size_t* written) {
+    // Every metric passed its checks, a write can still be refused by the writer itself
+    bool result = true;
+    for (size_t i = 0; i < stage->count; i++) {
+        size_t arena_mark = _CTX->decode_arena.used;
+        if (_commit_staged_write(stage, &(stage->writes[i]), callback)) {
+            (*written)++;
+        } else {
+            result = false;
+        }
+        _CTX->decode_arena.used = arena_mark;
+    }
+    _reset_ncmd_stage(stage, false);
+    return result;
+}
+
+
+typedef union {
+    uint32_t int_value;
+    uint64_t long_value;
+    float float_value;
+    double double_value;
+    bool boolean_value;
+} _MetricScalar;  // Same layout as the scalar members of Payload_Metric.value
+
+
+static bool _metric_datatype_accepted(uint32_t datatype, FunctionalBasicTag* tag_ptr) {
+    if (datatype == (uint32_t)(tag_ptr->datatype)) return true;
+    // Ignition (Java) sends uint64 as int64, so make exception for that scenario
+    return tag_ptr->datatype == spUInt64 || datatype == (uint32_t)spInt64;
+}
+
+
+static bool _scalar_to_basic_value(const _MetricScalar* scalar, BasicValue* value) {
+    // Converts to value->datatype, false for datatypes that aren't scalars
+    switch (value->datatype) {
+        case spInt8:
+            value->value.int8Value = (int8_t)(scalar->int_value);
+            break;
+        case spInt16:
+            value->value.int16Value = (int16_t)(scalar->int_value);
+            break;
+        case spInt32:
+            value->value.int32Value = (int32_t)(scalar->int_value);
+            break;
+        case spInt64:
+            value->value.int64Value = (int64_t)(scalar->long_value);
+            break;
+        case spUInt8:
+            value->value.uint8Value = (uint8_t)(scalar->int_value);
+            break;
+        case spUInt16:
+            value->value.uint16Value = (uint16_t)(scalar->int_value);
+            break;
+        case spUInt32:
+            value->value.uint32Value = (uint32_t)(scalar->int_value);
+            break;
+        case spDateTime:
+        case spUInt64:
+            value->value.uint64Value = (uint64_t)(scalar->long_value);
+            break;
+        case spFloat:
+            value->value.floatValue = scalar->float_value;
+            break;
+        case spDouble:
+            value->value.doubleValue = scalar->double_value;
+            break;
+        case spBoolean:
+            value->value.boolValue = scalar->boolean_value;
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+
+static bool _decode_metric(pb_istream_t *stream, void **arg) {
+    const _DecodeArgs* args = (const _DecodeArgs*)(*arg);
+    Payload_Metric metric = Payload_Metric_init_zero;
+    BasicValue metric_value;
+    metric_value.value.bytesValue = NULL;
+    // Views point into the input and are never freed
+    _DecodeView name_view = {NULL, 0};
+    BufferValue value_view = {NULL, 0, 0};
+
+    if (args->views) {
+        metric.name.funcs.decode = _decode_name_view_callback;
+        metric.name.arg = &name_view;
+        metric.value.bytes_value.funcs.decode = _decode_buffer_view_callback;
+        metric.value.bytes_value.arg = &value_view;
+    } else {
+        metric.name.funcs.decode = _decode_string_callback;
+        metric.name.arg = NULL;
+        // set decode in case the metric is string or bytes
+        metric.value.bytes_value.funcs.decode = _decode_buffer_callback;
+        metric.value.bytes_value.arg = &metric_value;
+    }
+
+    if (!pb_decode(stream, Payload_Metric_fields, &metric)) {
+        if (!args->views) {
+            _decode_free(metric.name.arg);
+            _decode_free_buffer_value(&metric_value);
+        }
+        return false;
+    }
+
+    //if (!_sp_datatype_valid())
+
+    FunctionalBasicTag* matchedTag = NULL;
+    if (metric.has_alias) {
+        // Get tag by alias, births only announce aliases from 0 to INT_MAX
+        if (metric.alias <= INT_MAX) matchedTag = findSparkplugTagByAlias((int)metric.alias);
+    } else if (args->views) {
+        // Matched in place, no copy of the name
+        if (name_view.data != NULL) matchedTag = _get_tag_by_name_view(name_view.data, name_view.length);
     } else if (metric.name.arg != NULL) {
         // If there was no alias, check and find it by name
-        matchedTag = getTagByName((char*)(metric.name.arg));
+        matchedTag = findSparkplugTagByName((char*)(metric.name.arg));
     }
 
     // free the name, no longer needed
-    if (metric.name.arg != NULL) {
-        free(metric.name.arg);
+    if (!(args->views) && metric.name.arg != NULL) {
+        _decode_free(metric.name.arg);
         metric.name.arg = NULL;
     }
     
+    // A staged NCMD is rejected by any metric that would be ignored
+    bool ignored = args->stage == NULL;
     if (matchedTag == NULL) {
         // No tag found, ignore this metric, but decode was successful
-        if (metric_value.value.bytesValue != NULL) deallocateBufferValue(&metric_value);
-        return true;
+        _decode_free_buffer_value(&metric_value);
+        return ignored;
     } else if (!(matchedTag->remote_writable)) {
         // Tag is not writable via NCMD, ignore it
-        if (metric_value.value.bytesValue != NULL) deallocateBufferValue(&metric_value);
-        return true;
+        _decode_free_buffer_value(&metric_value);
+        return ignored;
     }
 
     // if incoming metric datatype does not match tag, ignore it
-    if (metric.datatype != matchedTag->datatype) {
-        // Ignition (Java) sends uint64 as int64, so make exception for that scenario
-        if (matchedTag->datatype != spUInt64 && metric.datatype != (int)spInt64) {
-            if (metric_value.value.bytesValue != NULL) deallocateBufferValue(&metric_value);
-            return true;
-        }
+    if (!_metric_datatype_accepted(metric.datatype, matchedTag)) {
+        _decode_free_buffer_value(&metric_value);
+        return ignored;
     }
 
     metric_value.datatype = matchedTag->datatype;
     metric_value.timestamp = metric.timestamp;
+    // Set only now so the checks above have nothing to free
+    if (args->views && value_view.buffer != NULL) metric_value.value.bytesValue = &value_view;
+    // A view over the input can't be freed, only a copy made here can
+    bool owns_value = !(args->views);
 
     if (metric.has_is_null && metric.is_null) {
         // Value is null
@@ -392,40 +1781,6 @@ static bool _decode_metric_callback(pb_istream_t *stream, const pb_field_iter_t
     } else {
         metric_value.isNull = false;
         switch (metric_value.datatype) {
-            case spInt8:
-                metric_value.value.int8Value = (int8_t)(metric.value.int_value);
-                break;
-            case spInt16:
-                metric_value.value.int16Value = (int16_t)(metric.value.int_value);
-                break;
-            case spInt32:
-                metric_value.value.int32Value = (int32_t)(metric.value.int_value);
-                break;
-            case spInt64:
-                metric_value.value.int64Value = (int64_t)(metric.value.long_value);
-                break;
-            case spUInt8:
-                metric_value.value.uint8Value = (uint8_t)(metric.value.int_value);
-                break;
-            case spUInt16:
-                metric_value.value.uint16Value = (uint16_t)(metric.value.int_value);
-                break;
-            case spUInt32:
-                metric_value.value.uint32Value = (uint32_t)(metric.value.int_value);
-                break;
-            case spDateTime:
-            case spUInt64:
-                metric_value.value.uint64Value = (uint64_t)(metric.value.long_value);
-                break;
-            case spFloat:
-                metric_value.value.floatValue = metric.value.float_value;
-                break;
-            case spDouble:
-                metric_value.value.doubleValue = metric.value.double_value;
-                break;
-            case spBoolean:
-                metric_value.value.boolValue = metric.value.boolean_value;
-                break;
             case spText:  // Text is a string
             case spUUID: // UUID is a string
             case spString:
@@ -433,137 +1788,792 @@ static bool _decode_metric_callback(pb_istream_t *stream, const pb_field_iter_t
                 {
                     // save the ptr to not lose it
                     BufferValue* buffer_ptr = metric_value.value.bytesValue;
+                    // No string value was sent, ignore the metric, a staged NCMD is rejected
+                    if (buffer_ptr == NULL) return ignored;
+                    if (args->views) {
+                        // Only a processNCMDViews callback gets the view, every other handler gets a NUL terminated copy
+                        if (args->stage == NULL && args->callback != NULL && _tag_command_callback(matchedTag) == NULL) break;
+                        if (buffer_ptr->written_length > _INCOMING_STRING_MAX_LEN) return false;
+                        char* copy = (char*)_decode_alloc(buffer_ptr->written_length + 1);
+                        if (copy == NULL) return false;
+                        memcpy(copy, buffer_ptr->buffer, buffer_ptr->written_length);
+                        copy[buffer_ptr->written_length] = '\0';
+                        metric_value.value.stringValue = copy;
+                        owns_value = true;
+                        break;
+                    }
                     // recast the buffer to char*, reset null terminator
                     buffer_ptr->buffer[buffer_ptr->allocated_length - 1] = '\0';
                     metric_value.value.stringValue = (char*)(buffer_ptr->buffer);
                     // free the BufferValue
-                    free(buffer_ptr);
+                    _decode_free(buffer_ptr);
                     break;
                 }
             case spBytes:
                 // Bytes is already set
                 break;
             default:
+                if (_scalar_to_basic_value((const _MetricScalar*)&(metric.value), &metric_value)) break;
                 // Datatype is invalid or unimplimented
-                if (metric_value.value.bytesValue != NULL) deallocateBufferValue(&metric_value);
-                return true; // decode successful, but the metric is ignored
+                if (owns_value) _decode_free_buffer_value(&metric_value);
+                return ignored; // decode successful, but the metric is ignored
         }
     }
 
     // Call the callback
-    DecodeMetricCallback callback = *(DecodeMetricCallback*)arg;
-    if (callback != NULL) {
-        callback(&metric_value, matchedTag);
+    bool result = true;
+    DecodeMetricCallback callback = args->callback;
+    if (args->stage != NULL) {
+        // Checked now, written once every metric has been
+        // validateWrite is checked for metrics that reach the default writer
+        bool validate = callback == NULL && _tag_command_callback(matchedTag) == NULL;
+        result = _stage_metric(args->stage, matchedTag, &metric_value, &value_view, validate);
     } else {
-        _on_decode_metric_default(&metric_value, matchedTag);
+        _dispatch_command(&metric_value, matchedTag, callback);
     }
 
     // Cleanup any allocations
+    if (!owns_value) return result;
     switch (metric_value.datatype) {
         case spText:  // Text is a string
         case spUUID: // UUID is a string
         case spString:
             // Deallocate String
-            if (metric_value.value.stringValue != NULL) free(metric_value.value.stringValue);
+            _decode_free(metric_value.value.stringValue);
             break;
         case spBytes:
             // Deallocate Bytes
-            if (metric_value.value.bytesValue != NULL) deallocateBufferValue(&metric_value);
+            _decode_free_buffer_value(&metric_value);
             break;
         default:
             // Nothing to deallocate
             break;
     }
+    return result;
+}
+
+
+/*
+Alias only metrics
+
+Hosts address known metrics by alias once the birth was received, so most NCMD metrics carry
+only the alias, timestamp, datatype and a scalar value. Those are read straight from the input
+into a BasicValue, without nanopb's field iterator or a Payload_Metric. Any other field, or a
+tag holding a string or bytes value, leaves the metric to the full decoder untouched.
+*/
+
+static bool _read_varint(const uint8_t** pos, const uint8_t* end, uint64_t* value) {
+    uint64_t result = 0;
+    for (uint8_t shift = 0; shift < 64 && *pos < end; shift += 7) {
+        uint8_t byte = *((*pos)++);
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool _read_fixed(const uint8_t** pos, const uint8_t* end, void* value, size_t size) {
+    if ((size_t)(end - *pos) < size) return false;
+    // Little endian on the wire, as nanopb's decoder assumes of the target
+    memcpy(value, *pos, size);
+    *pos += size;
+    return true;
+}
+
+
+static bool _decode_alias_metric(pb_istream_t *stream, const _DecodeArgs* args, bool* result) {
+    // Returns false when the metric needs the full decoder, the stream is then left as it was
+    if (stream->callback != _decode_from_buffer_callback) return false;
+    const uint8_t* pos = (const uint8_t*)(stream->state);
+    const uint8_t* end = pos + stream->bytes_left;
+
+    bool has_alias = false;
+    uint64_t alias = 0;
+    uint64_t timestamp = 0;
+    uint64_t datatype = 0;
+    bool is_null = false;
+    _MetricScalar scalar;
+    scalar.long_value = 0;
+    uint64_t varint;
+
+    while (pos < end) {
+        // Every field read here has a one byte key, case labels need the macro rather than the constants
+        switch (*(pos++)) {
+            case _FIELD_KEY(Payload_Metric_alias_tag, PB_WT_VARINT):
+                if (!_read_varint(&pos, end, &alias)) return false;
+                has_alias = true;
+                break;
+            case _FIELD_KEY(Payload_Metric_timestamp_tag, PB_WT_VARINT):
+                if (!_read_varint(&pos, end, &timestamp)) return false;
+                break;
+            case _FIELD_KEY(Payload_Metric_datatype_tag, PB_WT_VARINT):
+                if (!_read_varint(&pos, end, &datatype) || datatype > UINT32_MAX) return false;
+                break;
+            case _FIELD_KEY(Payload_Metric_is_historical_tag, PB_WT_VARINT):
+            case _FIELD_KEY(Payload_Metric_is_transient_tag, PB_WT_VARINT):
+                if (!_read_varint(&pos, end, &varint)) return false;
+                break;
+            case _FIELD_KEY(Payload_Metric_is_null_tag, PB_WT_VARINT):
+                if (!_read_varint(&pos, end, &varint) || varint > UINT32_MAX) return false;
+                is_null = varint != 0;
+                break;
+            case _FIELD_KEY(Payload_Metric_int_value_tag, PB_WT_VARINT):
+                if (!_read_varint(&pos, end, &varint) || varint > UINT32_MAX) return false;
+                scalar.long_value = 0;
+                scalar.int_value = (uint32_t)varint;
+                break;
+            case _FIELD_KEY(Payload_Metric_long_value_tag, PB_WT_VARINT):
+                if (!_read_varint(&pos, end, &varint)) return false;
+                scalar.long_value = varint;
+                break;
+            case _FIELD_KEY(Payload_Metric_float_value_tag, PB_WT_32BIT):
+                scalar.long_value = 0;
+                if (!_read_fixed(&pos, end, &(scalar.float_value), sizeof(float))) return false;
+                break;
+            case _FIELD_KEY(Payload_Metric_double_value_tag, PB_WT_64BIT):
+                if (!_read_fixed(&pos, end, &(scalar.double_value), sizeof(double))) return false;
+                break;
+            case _FIELD_KEY(Payload_Metric_boolean_value_tag, PB_WT_VARINT):
+                if (!_read_varint(&pos, end, &varint) || varint > UINT32_MAX) return false;
+                scalar.long_value = 0;
+                scalar.boolean_value = varint != 0;
+                break;
+            default:
+                return false;
+        }
+    }
+    if (!has_alias) return false;
+
+    FunctionalBasicTag* matchedTag = alias <= INT_MAX ? findSparkplugTagByAlias((int)alias) : NULL;
+    if (matchedTag != NULL) {
+        switch (matchedTag->datatype) {
+            case spText:
+            case spUUID:
+            case spString:
+            case spBytes:
+                return false;
+            default:
+                break;
+        }
+    }
+
+    // Decided, the metric is consumed
+    stream->state = (void*)end;
+    stream->bytes_left = 0;
+    // Same rules as _decode_metric, a staged NCMD is rejected by a metric that would be ignored
+    *result = args->stage == NULL;
+    if (matchedTag == NULL || !(matchedTag->remote_writable)) return true;
+    if (!_metric_datatype_accepted((uint32_t)datatype, matchedTag)) return true;
+
+    BasicValue metric_value;
+    metric_value.value.uint64Value = 0;
+    metric_value.datatype = matchedTag->datatype;
+    metric_value.timestamp = timestamp;
+    metric_value.isNull = is_null;
+    if (!is_null && !_scalar_to_basic_value(&scalar, &metric_value)) return true;
+
+    if (args->stage != NULL) {
+        BufferValue no_view = {NULL, 0, 0};
+        bool validate = args->callback == NULL && _tag_command_callback(matchedTag) == NULL;
+        *result = _stage_metric(args->stage, matchedTag, &metric_value, &no_view, validate);
+    } else {
+        _dispatch_command(&metric_value, matchedTag, args->callback);
+        *result = true;
+    }
+    return true;
+}
+
+
+static bool _decode_metric_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
+    size_t arena_mark = _CTX->decode_arena.used;
+    bool result;
+    if (!_decode_alias_metric(stream, (const _DecodeArgs*)(*arg), &result)) result = _decode_metric(stream, arg);
+    _CTX->decode_arena.used = arena_mark;
+    return result;
+}
+
+
+static bool _decode_payload(const uint8_t *payload_buf, size_t length, Payload *decoded_payload, DecodeMetricCallback onMetricCallback, bool views, _NCMDStage* stage) {
+    pb_istream_t stream = _istream_from_buffer(payload_buf, length);
+
+    _DecodeArgs args = {onMetricCallback, views, stage};
+    decoded_payload->metrics.funcs.decode = _decode_metric_callback;
+    decoded_payload->metrics.arg = &args;
+    bool status = pb_decode(&stream, Payload_fields, decoded_payload);
+    return status;
+}
+
+
+/*
+NCMD queue
+
+Single producer, single consumer queue between the context receiving NCMDs and the one owning
+the tags. queueNCMD only splits the NCMD into its metrics and copies each encoded metric into a
+slot, it touches no tag, heap or decoder state, so it can run in an MQTT client task or callback
+while the main loop scans. applyNCMDQueue decodes and writes the queued metrics where tags are
+safe to write. The metrics of an NCMD are published to the consumer together once the whole NCMD
+was queued, a failed NCMD queues nothing.
+*/
+
+typedef struct {
+    SparkplugNCMDQueue* queue;
+    size_t head;  // Next slot, published when the NCMD is complete
+    size_t tail;
+    size_t queued;
+} _NCMDQueueProducer;
+
+
+static bool _queue_metric_callback(pb_istream_t *stream, const pb_field_iter_t *field, void **arg) {
+    _NCMDQueueProducer* producer = (_NCMDQueueProducer*)(*arg);
+    SparkplugNCMDQueue* queue = producer->queue;
+    size_t length = stream->bytes_left;
+    size_t next = (producer->head + 1) % queue->count;
+    // Metric too large for a slot, or the queue is full
+    if (length > queue->slot_size || next == producer->tail) return false;
+
+    uint8_t* slot = &(queue->data[producer->head * queue->slot_size]);
+    if (!pb_read(stream, slot, length)) return false;
+    // A malformed metric fails the NCMD now, string fields without a callback are skipped
+    Payload_Metric metric = Payload_Metric_init_zero;
+    pb_istream_t metric_stream = pb_istream_from_buffer(slot, length);
+    if (!pb_decode(&metric_stream, Payload_Metric_fields, &metric)) return false;
+
+    queue->lengths[producer->head] = length;
+    queue->last[producer->head] = false;
+    producer->head = next;
+    producer->queued++;
+    return true;
+}
+
+
+/*
+Streamed NCMD
+
+An NCMD fed in chunks as it arrives from the network. nanopb pulls its input and can't stop part
+way through a message, so the Payload fields are read by a small state machine that resumes at
+any byte. Each metric is gathered into the stream buffer and decoded as a whole once complete,
+the buffer only has to hold the largest single metric, not the whole NCMD. Payload fields other
+than metrics are skipped.
+*/
+
+enum {
+    _NCMD_STREAM_KEY = 0,
+    _NCMD_STREAM_LENGTH,
+    _NCMD_STREAM_VARINT,  // Value of a varint field, skipped
+    _NCMD_STREAM_METRIC,
+    _NCMD_STREAM_SKIP
+};
+
+
+static bool _ncmd_stream_varint_byte(SparkplugNCMDStream* ncmd_stream, uint8_t byte, bool* complete) {
+    if (ncmd_stream->varint_shift >= 64) return false;
+    ncmd_stream->varint |= (uint64_t)(byte & 0x7F) << ncmd_stream->varint_shift;
+    ncmd_stream->varint_shift += 7;
+    *complete = (byte & 0x80) == 0;
+    return true;
+}
+
+
+static bool _decode_metric_bytes(const uint8_t* bytes, size_t length, DecodeMetricCallback callback, _NCMDStage* stage) {
+    // One encoded metric, same modes as processNCMD and processNCMDStaged
+    pb_istream_t stream = _istream_from_buffer(bytes, length);
+    _DecodeArgs args = {callback, callback == NULL || stage != NULL, stage};
+    void* arg = &args;
+    return _decode_metric_callback(&stream, NULL, &arg);
+}
+
+
+static bool _ncmd_stream_decode_metric(SparkplugNCMDStream* ncmd_stream) {
+    // Views point into the stream buffer
+    return _decode_metric_bytes(ncmd_stream->buffer, ncmd_stream->used, ncmd_stream->callback, ncmd_stream->staged ? &(_CTX->ncmd_stage) : NULL);
+}
+
+
+static bool _ncmd_stream_field(SparkplugNCMDStream* ncmd_stream, uint64_t value) {
+    // A varint finished in one of the KEY, LENGTH or VARINT states
+    switch (ncmd_stream->state) {
+        case _NCMD_STREAM_KEY:
+            ncmd_stream->field = (uint32_t)(value >> 3);
+            if (ncmd_stream->field == 0 || (value >> 3) > UINT32_MAX) return false;
+            switch ((pb_wire_type_t)(value & 0x07)) {
+                case PB_WT_VARINT:
+                    ncmd_stream->state = _NCMD_STREAM_VARINT;
+                    break;
+                case PB_WT_64BIT:
+                    ncmd_stream->remaining = 8;
+                    ncmd_stream->state = _NCMD_STREAM_SKIP;
+                    break;
+                case PB_WT_32BIT:
+                    ncmd_stream->remaining = 4;
+                    ncmd_stream->state = _NCMD_STREAM_SKIP;
+                    break;
+                case PB_WT_STRING:
+                    ncmd_stream->state = _NCMD_STREAM_LENGTH;
+                    break;
+                default:
+                    return false;
+            }
+            // Metrics are only valid as length delimited messages
+            return ncmd_stream->field != Payload_metrics_tag || ncmd_stream->state == _NCMD_STREAM_LENGTH;
+        case _NCMD_STREAM_LENGTH:
+            if (value > SIZE_MAX) return false;
+            ncmd_stream->remaining = (size_t)value;
+            if (ncmd_stream->field != Payload_metrics_tag) {
+                ncmd_stream->state = value == 0 ? _NCMD_STREAM_KEY : _NCMD_STREAM_SKIP;
+                return true;
+            }
+            // The metric has to fit in the stream buffer
+            if (value > ncmd_stream->size) return false;
+            ncmd_stream->used = 0;
+            ncmd_stream->state = _NCMD_STREAM_METRIC;
+            if (value > 0) return true;
+            ncmd_stream->state = _NCMD_STREAM_KEY;
+            return _ncmd_stream_decode_metric(ncmd_stream);
+        default:
+            ncmd_stream->state = _NCMD_STREAM_KEY;
+            return true;
+    }
+}
+
+
+static bool _ncmd_stream_feed(SparkplugNCMDStream* ncmd_stream, const uint8_t* chunk, size_t length) {
+    size_t pos = 0;
+    while (pos < length) {
+        size_t count;
+        switch (ncmd_stream->state) {
+            case _NCMD_STREAM_METRIC:
+                count = length - pos < ncmd_stream->remaining ? length - pos : ncmd_stream->remaining;
+                memcpy(&(ncmd_stream->buffer[ncmd_stream->used]), &(chunk[pos]), count);
+                ncmd_stream->used += count;
+                ncmd_stream->remaining -= count;
+                pos += count;
+                if (ncmd_stream->remaining == 0) {
+                    ncmd_stream->state = _NCMD_STREAM_KEY;
+                    if (!_ncmd_stream_decode_metric(ncmd_stream)) return false;
+                }
+                break;
+            case _NCMD_STREAM_SKIP:
+                count = length - pos < ncmd_stream->remaining ? length - pos : ncmd_stream->remaining;
+                ncmd_stream->remaining -= count;
+                pos += count;
+                if (ncmd_stream->remaining == 0) ncmd_stream->state = _NCMD_STREAM_KEY;
+                break;
+            default: {
+                bool complete = false;
+                if (!_ncmd_stream_varint_byte(ncmd_stream, chunk[pos], &complete)) return false;
+                pos++;
+                if (!complete) break;
+                uint64_t value = ncmd_stream->varint;
+                ncmd_stream->varint = 0;
+                ncmd_stream->varint_shift = 0;
+                if (!_ncmd_stream_field(ncmd_stream, value)) return false;
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+
+/*
+Sparkplug Functions
+*/
+
+static bool _make_ndeath_payload(BufferValue* buffer_ptr, _EncodeStream* encodeStream, uint64_t timestamp) {
+    // Get the bdSeq Tag
+    FunctionalBasicTag* bdSeq_tag = getBdSeqTag();
+    if (bdSeq_tag == NULL || !_CTX->node_initialized) return false;  // bdSeq doesn't exist, can't make ndeath payload
+
+    Payload payload = Payload_init_zero;
+
+    payload.has_timestamp = true;
+    payload.timestamp = timestamp;
+
+    _MetricFields metric;
+    _tag_to_metric_fields(bdSeq_tag, NULL, false, false, &metric);
+    metric.name = _bdseq_tag_name;
+    metric.name_length = strlen(_bdseq_tag_name);
+    metric.has_alias = false;
+
+    // override timestamp value
+    metric.timestamp = payload.timestamp;
+
+    payload.metrics.funcs.encode = _pb_encode_single_metric_callback;
+    payload.metrics.arg = &metric;
+
+    return _encode_payload(&payload, buffer_ptr, encodeStream);
+}
+
+
+static bool _make_ddeath_payload(BufferValue* buffer_ptr, _EncodeStream* encodeStream, uint64_t timestamp, int sequence) {
+    // A DDEATH only carries the timestamp and sequence number
+    if (!_CTX->node_initialized) return false;
+
+    Payload payload = Payload_init_zero;
+
+    payload.has_timestamp = true;
+    payload.timestamp = timestamp;
+    payload.has_seq = true;
+    payload.seq = sequence;
+
+    return _encode_payload(&payload, buffer_ptr, encodeStream);
+}
+
+
+static bool _make_metrics_payload(BufferValue* buffer_ptr, _EncodeStream* encodeStream, uint64_t timestamp, int sequence, bool isBirth, bool isHistorical) {
+    if (!_CTX->node_initialized) return false;
+
+    Payload payload = Payload_init_zero;
+    payload.has_timestamp = true;
+    payload.timestamp = timestamp;
+    payload.has_seq = true;
+    payload.seq = sequence;
+
+    _MetricsEncodeArgs args = {isBirth, isHistorical, false, 0};
+    payload.metrics.funcs.encode = _pb_encode_metrics_callback;
+    payload.metrics.arg = (void*)(&args);
+
+    if (!_encode_payload(&payload, buffer_ptr, encodeStream)) return false;
+    // The changed tag list belongs to a single NDATA
+    if (!isBirth) _CTX->dirty_tags.valid = false;
+    return true;
+}
+
+
+static bool _make_metrics_iovec(BufferValue* buffer_ptr, SparkplugIOVecList* iov, uint64_t timestamp, int sequence, bool isBirth, bool isHistorical) {
+    if (!_CTX->node_initialized || buffer_ptr == NULL || iov == NULL || iov->vecs == NULL) return false;
+
+    Payload payload = Payload_init_zero;
+    payload.has_timestamp = true;
+    payload.timestamp = timestamp;
+    payload.has_seq = true;
+    payload.seq = sequence;
+
+    _MetricsEncodeArgs args = {isBirth, isHistorical, false, 0};
+    payload.metrics.funcs.encode = _pb_encode_metrics_callback;
+    payload.metrics.arg = (void*)(&args);
+
+    if (!_encode_payload_to_iovec(&payload, buffer_ptr, iov)) return false;
+    if (!isBirth) _CTX->dirty_tags.valid = false;
+    return true;
+}
+
+
+static size_t _metrics_payload_size(uint64_t timestamp, int sequence, bool isBirth, bool isHistorical) {
+    // Exact encoded length of the payload _make_metrics_payload would make, 0 on failure
+    if (!_CTX->node_initialized) return 0;
+
+    Payload payload = Payload_init_zero;
+    payload.has_timestamp = true;
+    payload.timestamp = timestamp;
+    payload.has_seq = true;
+    payload.seq = sequence;
+
+    _MetricsEncodeArgs args = {isBirth, isHistorical, false, 0};
+    payload.metrics.funcs.encode = _pb_encode_metrics_callback;
+    payload.metrics.arg = (void*)(&args);
+
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    if (!_encode_payload_message(&stream, &payload)) return 0;
+    return stream.bytes_written;
+}
+
+
+static bool _make_ndata_part(BufferValue* buffer_ptr, uint64_t timestamp, int sequence, bool isHistorical, bool* morePending) {
+    if (!_CTX->node_initialized || buffer_ptr == NULL) return false;
+
+    Payload payload = Payload_init_zero;
+    payload.has_timestamp = true;
+    payload.timestamp = timestamp;
+    payload.has_seq = true;
+    payload.seq = sequence;
+
+    _MetricsEncodeArgs args = {false, isHistorical, true, 1 + _varint_size((uint64_t)sequence)};
+    payload.metrics.funcs.encode = _pb_encode_metrics_callback;
+    payload.metrics.arg = (void*)(&args);
+
+    if (!_encode_payload(&payload, buffer_ptr, NULL)) {
+        // Give up on the rest of this NDATA
+        _CTX->ndata_split.next = 0;
+        _CTX->ndata_split.pending = false;
+        return false;
+    }
+    *morePending = _CTX->ndata_split.pending;
+    if (!(*morePending)) _CTX->dirty_tags.valid = false;
+    return true;
+}
+
+
+static size_t _frozen_bytes_length(const BasicValue* value) {
+    if (_metric_value_is_null(value)) return 0;
+    switch (value->datatype) {
+        case spText:
+        case spUUID:
+        case spString:
+            // With the terminator, the copy is read back as a C string
+            return value->value.stringValue == NULL ? 0 : strlen(value->value.stringValue) + 1;
+        case spBytes:
+            return _bytes_value_length(value);
+        default:
+            return 0;
+    }
+}
+
+
+static bool _freeze_birth_values() {
+    // Copies the value of every tag in the birth cache, the cache must be current
+    size_t count = _CTX->birth_cache.count;
+    size_t bytes_needed = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes_needed += _frozen_bytes_length(&(_tag_at(i)->currentValue));
+    }
+
+    if (count > _CTX->birth_cache.frozen_allocated) {
+        _FrozenValue* frozen = (_FrozenValue*)realloc(_CTX->birth_cache.frozen, count * sizeof(_FrozenValue));
+        if (frozen == NULL) return false;
+        _CTX->birth_cache.frozen = frozen;
+        _CTX->birth_cache.frozen_allocated = count;
+    }
+    if (bytes_needed > _CTX->birth_cache.frozen_bytes_allocated) {
+        uint8_t* bytes = (uint8_t*)realloc(_CTX->birth_cache.frozen_bytes, bytes_needed);
+        if (bytes == NULL) return false;
+        _CTX->birth_cache.frozen_bytes = bytes;
+        _CTX->birth_cache.frozen_bytes_allocated = bytes_needed;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        FunctionalBasicTag* tag_ptr = _tag_at(i);
+        _FrozenValue* frozen = &(_CTX->birth_cache.frozen[i]);
+        frozen->value = tag_ptr->currentValue;
+        frozen->read_only = !(tag_ptr->remote_writable);
+        frozen->bytes_offset = used;
+        frozen->bytes_length = _frozen_bytes_length(&(frozen->value));
+        if (frozen->bytes_length == 0) continue;
+        const void* source = frozen->value.datatype == spBytes ? (const void*)(frozen->value.value.bytesValue->buffer) : (const void*)(frozen->value.value.stringValue);
+        memcpy(&(_CTX->birth_cache.frozen_bytes[used]), source, frozen->bytes_length);
+        used += frozen->bytes_length;
+    }
     return true;
 }
 
 
-static bool _decode_payload(const uint8_t *payload_buf, size_t length, Payload *decoded_payload, DecodeMetricCallback onMetricCallback) {
-    pb_istream_t stream = pb_istream_from_buffer(payload_buf, length);
+static void _frozen_to_metric_fields(size_t idx, bool is_historical, _MetricFields* metric, BasicValue* value, BufferValue* bytes) {
+    // Same as _tag_to_metric_fields for a birth, with the value copied by the first fragment
+    const _BirthCacheEntry* cached = &(_CTX->birth_cache.entries[idx]);
+    const _FrozenValue* frozen = &(_CTX->birth_cache.frozen[idx]);
+    *value = frozen->value;
+    uint8_t* data = frozen->bytes_length > 0 ? &(_CTX->birth_cache.frozen_bytes[frozen->bytes_offset]) : NULL;
+    if (!_metric_value_is_null(value) && value->datatype == spBytes && value->value.bytesValue != NULL) {
+        // Never the tag's BufferValue, its length can change too
+        bytes->buffer = data;
+        bytes->allocated_length = frozen->bytes_length;
+        bytes->written_length = frozen->bytes_length;
+        value->value.bytesValue = bytes;
+    } else if (data != NULL) {
+        value->value.stringValue = (char*)data;
+    }
+    _tag_to_metric_fields(cached->tag, cached, true, is_historical, metric);
+    bool cached_datatype = cached->datatype == value->datatype;
+    metric->datatype_field = cached_datatype ? cached->datatype_field : NULL;
+    metric->datatype_field_length = cached_datatype ? cached->datatype_field_length : 0;
+    metric->timestamp = value->timestamp;
+    metric->read_only = frozen->read_only;
+    metric->value = value;
+}
+
+
+static bool _encode_nbirth_window(_EncodeWindow* window) {
+    /*
+    Encodes the birth from the recorded resume position to the end of the window, and records
+    where the next fragment resumes. Returns false if encoding failed or the tag set changed
+    */
+    _NBIRTHFragments* fragments = &(_CTX->nbirth_fragments);
+    size_t window_end = window->offset + window->buffer->allocated_length;
+    size_t count = _CTX->birth_cache.count;
+
+    pb_ostream_t stream = PB_OSTREAM_SIZING;
+    stream.callback = _encode_to_window_callback;
+    stream.state = (void*)window;
+    stream.max_size = SIZE_MAX;
+    // Positions are absolute in the payload, the window skips what lies before its offset
+    stream.bytes_written = fragments->next_position;
+
+    if (stream.bytes_written == 0) {
+        if (!pb_write(&stream, &_PAYLOAD_TIMESTAMP_KEY, 1)) return window->full;
+        if (!pb_encode_varint(&stream, fragments->timestamp)) return window->full;
+    }
+    for (size_t k = fragments->next_metric; k < count; k++) {
+        size_t start = stream.bytes_written;
+        if (start >= window_end) {
+            fragments->next_metric = k;
+            fragments->next_position = start;
+            return true;
+        }
+        // The tag set changed since the first fragment
+        if (_birth_cache_entry(k, _tag_at(k)) == NULL) return false;
+
+        _MetricFields metric;
+        BasicValue value;
+        BufferValue bytes;
+        _frozen_to_metric_fields(k, fragments->is_historical, &metric, &value, &bytes);
+        bool encoded = _encode_metric(&stream, &metric);
+        if (!encoded && !(window->full)) return false;
+        if (!encoded || stream.bytes_written > window_end) {
+            // The metric continues in the next fragment
+            fragments->next_metric = k;
+            fragments->next_position = start;
+            return true;
+        }
+    }
 
-    decoded_payload->metrics.funcs.decode = _decode_metric_callback;
-    if (onMetricCallback != NULL) decoded_payload->metrics.arg = onMetricCallback;
-    bool status = pb_decode(&stream, Payload_fields, decoded_payload);
-    return status;
+    size_t start = stream.bytes_written;
+    fragments->next_metric = count;
+    fragments->next_position = start;
+    if (start >= window_end) return true;
+    if (!pb_write(&stream, &_PAYLOAD_SEQ_KEY, 1) || !pb_encode_varint(&stream, (uint64_t)(fragments->sequence))) return window->full;
+    if (stream.bytes_written > window_end) return true;
+    // The last fragment, the birth must have kept the length of the first
+    fragments->active = false;
+    return stream.bytes_written == fragments->total_length;
 }
 
 
-/*
-Sparkplug Functions
-*/
+static bool _make_nbirth_fragment(BufferValue* buffer_ptr, uint64_t timestamp, int sequence, bool isHistorical, size_t offset, size_t* totalLength) {
+    if (!_CTX->node_initialized || buffer_ptr == NULL) return false;
+    _NBIRTHFragments* fragments = &(_CTX->nbirth_fragments);
+
+    if (offset == 0) {
+        // A new birth, the values of every fragment are taken now
+        fragments->active = false;
+        if (!buildSparkplugBirthCache() || !_freeze_birth_values()) return false;
+        // Size the birth up front so the first fragment can stop at the end of its window too
+        *totalLength = _metrics_payload_size(timestamp, sequence, true, isHistorical);
+        if (*totalLength == 0) return false;
+        fragments->active = true;
+        fragments->is_historical = isHistorical;
+        fragments->timestamp = timestamp;
+        fragments->sequence = sequence;
+        fragments->total_length = *totalLength;
+        fragments->next_metric = 0;
+        fragments->next_position = 0;
+    } else {
+        // The first fragment establishes the total length, later ones must be within it
+        if (!(fragments->active) || offset >= *totalLength || *totalLength != fragments->total_length) return false;
+        if (timestamp != fragments->timestamp || sequence != fragments->sequence || isHistorical != fragments->is_historical) return false;
+        if (offset < fragments->next_position) {
+            // A fragment sent again, encoded from the start with the same values
+            fragments->next_metric = 0;
+            fragments->next_position = 0;
+        }
+    }
 
-static bool _make_ndeath_payload(BufferValue* buffer_ptr, StreamFunction streamFn, uint64_t timestamp) {
-    // Get the bdSeq Tag
-    FunctionalBasicTag* bdSeq_tag = getTagByName("bdSeq");
-    if (bdSeq_tag == NULL || !_NODE_INITIALIZED) return false;  // bdSeq doesn't exist, can't make ndeath payload
+    _EncodeWindow window = {buffer_ptr, offset, false};
+    buffer_ptr->written_length = 0;
+    if (!_encode_nbirth_window(&window)) {
+        fragments->active = false;
+        buffer_ptr->written_length = 0;
+        return false;
+    }
+    return true;
+}
 
-    Payload payload = Payload_init_zero;
 
-    payload.has_timestamp = true;
-    payload.timestamp = timestamp;
+bool encodePayloadToStream(Payload* payload, StreamFunction streamFn, void* ctx) {
+    if (streamFn == NULL) return false;
+    // Shares the staging memory of the encode stream
+    _EncodeStream out = _CTX->encode_stream;
+    out.write = streamFn;
+    out.ctx = ctx;
+    bool result = _encode_payload(payload, NULL, &out);
+    _CTX->encode_stream.staging = out.staging;
+    return result;
+}
 
-    Payload_Metric metric = Payload_Metric_init_zero;
-    metric.name.funcs.encode = _pb_encode_string_callback;
-    metric.name.arg = "bdSeq";
+bool encodePayloadToBuffer(Payload* payload, BufferValue* buffer) {
+    return _encode_payload(payload, buffer, NULL);
+}
 
-    _basic_value_to_metric(&(bdSeq_tag->currentValue), &metric);
 
-    // override timestamp value
-    metric.timestamp = payload.timestamp;
+bool makeNDEATH(uint64_t timestamp) {
+    return _make_ndeath_payload(_CTX->encode_buffer, &(_CTX->encode_stream), timestamp);
+}
 
-    payload.metrics.funcs.encode = _pb_encode_single_metric_callback;
-    payload.metrics.arg = &metric;
+bool makeDDEATH(uint64_t timestamp, int sequence) {
+    return _make_ddeath_payload(_CTX->encode_buffer, &(_CTX->encode_stream), timestamp, sequence);
+}
 
-    return _encode_payload(&payload, buffer_ptr, streamFn);
+bool makeNBIRTH(uint64_t timestamp, int sequence) {
+    return _make_metrics_payload(_CTX->encode_buffer, &(_CTX->encode_stream), timestamp, sequence, true, false);
 }
 
+bool makeHistoricalNBIRTH(uint64_t timestamp, int sequence) {
+    return _make_metrics_payload(_CTX->encode_buffer, &(_CTX->encode_stream), timestamp, sequence, true, true);
+}
 
-static bool _make_metrics_payload(BufferValue* buffer_ptr, StreamFunction streamFn, uint64_t timestamp, int sequence, bool isBirth, bool isHistorical) {
-    if (!_NODE_INITIALIZED) return false;
+bool makeNDATA(uint64_t timestamp, int sequence) {
+    return _make_metrics_payload(_CTX->encode_buffer, &(_CTX->encode_stream), timestamp, sequence, false, false);
+}
 
-    Payload payload = Payload_init_zero;
-    payload.has_timestamp = true;
-    payload.timestamp = timestamp;
-    payload.has_seq = true;
-    payload.seq = sequence;
+bool makeHistoricalNDATA(uint64_t timestamp, int sequence) {
+    return _make_metrics_payload(_CTX->encode_buffer, &(_CTX->encode_stream), timestamp, sequence, false, true);
+}
 
-    bool flags[2];
-    flags[0] = isBirth;
-    flags[1] = isHistorical;
-    payload.metrics.funcs.encode = _pb_encode_metrics_callback;
-    payload.metrics.arg = (void*)(&flags);
+bool makeNBIRTHIOVec(uint64_t timestamp, int sequence, SparkplugIOVecList* iov) {
+    return _make_metrics_iovec(_CTX->encode_buffer, iov, timestamp, sequence, true, false);
+}
 
-    return _encode_payload(&payload, buffer_ptr, streamFn);
+bool makeHistoricalNBIRTHIOVec(uint64_t timestamp, int sequence, SparkplugIOVecList* iov) {
+    return _make_metrics_iovec(_CTX->encode_buffer, iov, timestamp, sequence, true, true);
 }
 
+bool makeNDATAIOVec(uint64_t timestamp, int sequence, SparkplugIOVecList* iov) {
+    return _make_metrics_iovec(_CTX->encode_buffer, iov, timestamp, sequence, false, false);
+}
 
-bool encodePayloadToStream(Payload* payload, StreamFunction streamFn) {
-    return _encode_payload(payload, NULL, streamFn);
+bool makeHistoricalNDATAIOVec(uint64_t timestamp, int sequence, SparkplugIOVecList* iov) {
+    return _make_metrics_iovec(_CTX->encode_buffer, iov, timestamp, sequence, false, true);
 }
 
-bool encodePayloadToBuffer(Payload* payload, BufferValue* buffer) {
-    return _encode_payload(payload, buffer, NULL);
+void setIOVecReferenceThreshold(size_t minLength) {
+    // 0 would add an entry for every empty string
+    _CTX->iovec_reference_min = minLength > 0 ? minLength : 1;
+}
+
+size_t getNBIRTHSize(uint64_t timestamp, int sequence) {
+    return _metrics_payload_size(timestamp, sequence, true, false);
 }
 
+size_t getHistoricalNBIRTHSize(uint64_t timestamp, int sequence) {
+    return _metrics_payload_size(timestamp, sequence, true, true);
+}
 
-bool makeNDEATH(uint64_t timestamp) {
-    return _make_ndeath_payload(_ENCODE_BUFFER, _ENCODE_STREAM, timestamp);
+size_t getNDATASize(uint64_t timestamp, int sequence) {
+    return _metrics_payload_size(timestamp, sequence, false, false);
 }
 
-bool makeNBIRTH(uint64_t timestamp, int sequence) {
-    return _make_metrics_payload(_ENCODE_BUFFER, _ENCODE_STREAM, timestamp, sequence, true, false);
+size_t getHistoricalNDATASize(uint64_t timestamp, int sequence) {
+    return _metrics_payload_size(timestamp, sequence, false, true);
 }
 
-bool makeHistoricalNBIRTH(uint64_t timestamp, int sequence) {
-    return _make_metrics_payload(_ENCODE_BUFFER, _ENCODE_STREAM, timestamp, sequence, true, true);
+bool makeNDATAPart(uint64_t timestamp, int sequence, bool* morePending) {
+    return _make_ndata_part(_CTX->encode_buffer, timestamp, sequence, false, morePending);
 }
 
-bool makeNDATA(uint64_t timestamp, int sequence) {
-    return _make_metrics_payload(_ENCODE_BUFFER, _ENCODE_STREAM, timestamp, sequence, false, false);
+bool makeHistoricalNDATAPart(uint64_t timestamp, int sequence, bool* morePending) {
+    return _make_ndata_part(_CTX->encode_buffer, timestamp, sequence, true, morePending);
 }
 
-bool makeHistoricalNDATA(uint64_t timestamp, int sequence) {
-    return _make_metrics_payload(_ENCODE_BUFFER, _ENCODE_STREAM, timestamp, sequence, false, true);
+bool makeNBIRTHFragment(uint64_t timestamp, int sequence, size_t offset, size_t* totalLength) {
+    return _make_nbirth_fragment(_CTX->encode_buffer, timestamp, sequence, false, offset, totalLength);
+}
+
+bool makeHistoricalNBIRTHFragment(uint64_t timestamp, int sequence, size_t offset, size_t* totalLength) {
+    return _make_nbirth_fragment(_CTX->encode_buffer, timestamp, sequence, true, offset, totalLength);
 }
 
 bool processNCMD(uint8_t* buffer, size_t length, DecodeMetricCallback metric_callback) {
@@ -572,22 +2582,362 @@ bool processNCMD(uint8_t* buffer, size_t length, DecodeMetricCallback metric_cal
     */
    Payload decoded_payload = Payload_init_zero;
 
-   bool result = _decode_payload(buffer, length, &decoded_payload, metric_callback);
+   // The default writer copies what it needs, so names and bytes values are always read in place
+   bool result = _decode_payload(buffer, length, &decoded_payload, metric_callback, metric_callback == NULL, NULL);
+
+   return result;
+}
+
+bool processNCMDViews(uint8_t* buffer, size_t length, DecodeMetricCallback metric_callback) {
+    /*
+    Decode NCMD without copying, string and bytes values reach metric_callback as BufferValue views
+    into buffer, valid until the callback returns
+    */
+   Payload decoded_payload = Payload_init_zero;
+
+   bool result = _decode_payload(buffer, length, &decoded_payload, metric_callback, true, NULL);
+
+   return result;
+}
+
+bool processNCMDStaged(uint8_t* buffer, size_t length, DecodeMetricCallback metric_callback, size_t* written) {
+    /*
+    Decode and check every NCMD metric before writing any, see Staged NCMD.
+    Returns false without writing if decoding fails or a metric is rejected,
+    written receives the number of metrics written (optional)
+    */
+   size_t written_count = 0;
+   if (written != NULL) *written = 0;
+   Payload decoded_payload = Payload_init_zero;
+
+   _reset_ncmd_stage(&(_CTX->ncmd_stage), false);
+   if (!_decode_payload(buffer, length, &decoded_payload, metric_callback, true, &(_CTX->ncmd_stage))) {
+       _reset_ncmd_stage(&(_CTX->ncmd_stage), false);
+       return false;
+   }
+   bool result = _commit_ncmd_stage(&(_CTX->ncmd_stage), metric_callback, &written_count);
+   if (written != NULL) *written = written_count;
 
    return result;
 }
 
+bool initNCMDStream(SparkplugNCMDStream* ncmd_stream, uint8_t* buffer, size_t size, DecodeMetricCallback metric_callback, bool staged) {
+    if (ncmd_stream == NULL || buffer == NULL || size == 0) return false;
+    ncmd_stream->buffer = buffer;
+    ncmd_stream->size = size;
+    ncmd_stream->callback = metric_callback;
+    ncmd_stream->staged = staged;
+    ncmd_stream->started = false;
+    resetNCMDStream(ncmd_stream);
+    return true;
+}
+
+void resetNCMDStream(SparkplugNCMDStream* ncmd_stream) {
+    // Drops a partly fed NCMD, staged metrics are discarded
+    if (ncmd_stream->started && ncmd_stream->staged) _reset_ncmd_stage(&(_CTX->ncmd_stage), false);
+    ncmd_stream->used = 0;
+    ncmd_stream->remaining = 0;
+    ncmd_stream->varint = 0;
+    ncmd_stream->varint_shift = 0;
+    ncmd_stream->field = 0;
+    ncmd_stream->state = _NCMD_STREAM_KEY;
+    ncmd_stream->started = false;
+    ncmd_stream->failed = false;
+}
+
+bool feedNCMDStream(SparkplugNCMDStream* ncmd_stream, const uint8_t* chunk, size_t length) {
+    /*
+    Decode the next bytes of an NCMD, metrics are handled as soon as they are complete
+    (or staged in staged mode). Returns false once the NCMD failed, the rest of it is ignored
+    */
+    if (ncmd_stream == NULL || ncmd_stream->buffer == NULL || ncmd_stream->failed) return false;
+    if (chunk == NULL && length > 0) return false;
+    if (!(ncmd_stream->started)) {
+        ncmd_stream->started = true;
+        if (ncmd_stream->staged) _reset_ncmd_stage(&(_CTX->ncmd_stage), true);
+    }
+    if (!_ncmd_stream_feed(ncmd_stream, chunk, length)) ncmd_stream->failed = true;
+    return !(ncmd_stream->failed);
+}
+
+bool finishNCMDStream(SparkplugNCMDStream* ncmd_stream, size_t* written) {
+    /*
+    End of the NCMD. Returns true if it was complete and valid, a staged NCMD is written now.
+    The stream is reset for the next NCMD. written is optional, only counted in staged mode
+    */
+    if (written != NULL) *written = 0;
+    if (ncmd_stream == NULL || ncmd_stream->buffer == NULL) return false;
+    bool result = !(ncmd_stream->failed) && ncmd_stream->state == _NCMD_STREAM_KEY && ncmd_stream->varint_shift == 0;
+    if (result && ncmd_stream->staged) {
+        size_t written_count = 0;
+        result = _commit_ncmd_stage(&(_CTX->ncmd_stage), ncmd_stream->callback, &written_count);
+        if (written != NULL) *written = written_count;
+    }
+    resetNCMDStream(ncmd_stream);
+    return result;
+}
+
+bool initNCMDQueue(SparkplugNCMDQueue* queue, size_t length, size_t slot_size) {
+    /*
+    Allocate a queue for length metrics of up to slot_size encoded bytes each
+    */
+    if (queue == NULL) return false;
+    queue->data = NULL;
+    queue->lengths = NULL;
+    queue->last = NULL;
+    queue->count = 0;
+    queue->slot_size = 0;
+    queue->head = 0;
+    queue->tail = 0;
+    if (length == 0 || slot_size == 0 || length == SIZE_MAX) return false;
+    // One slot is always left empty to tell a full queue from an empty one
+    size_t count = length + 1;
+    if (slot_size > SIZE_MAX / count) return false;
+    queue->data = (uint8_t*)malloc(count * slot_size);
+    queue->lengths = (size_t*)malloc(count * sizeof(size_t));
+    queue->last = (bool*)malloc(count * sizeof(bool));
+    if (queue->data == NULL || queue->lengths == NULL || queue->last == NULL) {
+        freeNCMDQueue(queue);
+        return false;
+    }
+    queue->count = count;
+    queue->slot_size = slot_size;
+    return true;
+}
+
+void freeNCMDQueue(SparkplugNCMDQueue* queue) {
+    if (queue == NULL) return;
+    if (queue->data != NULL) free(queue->data);
+    if (queue->lengths != NULL) free(queue->lengths);
+    if (queue->last != NULL) free(queue->last);
+    queue->data = NULL;
+    queue->lengths = NULL;
+    queue->last = NULL;
+    queue->count = 0;
+    queue->slot_size = 0;
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+bool queueNCMD(SparkplugNCMDQueue* queue, const uint8_t* buffer, size_t length) {
+    /*
+    Producer side, queue the metrics of an NCMD. Returns false without queueing anything if the
+    NCMD is malformed, a metric is larger than a slot or the queue is full
+    */
+    if (queue == NULL || queue->data == NULL || (buffer == NULL && length > 0)) return false;
+    _NCMDQueueProducer producer;
+    producer.queue = queue;
+    producer.head = __atomic_load_n(&(queue->head), __ATOMIC_RELAXED);
+    producer.tail = __atomic_load_n(&(queue->tail), __ATOMIC_ACQUIRE);
+    producer.queued = 0;
+
+    Payload payload = Payload_init_zero;
+    payload.metrics.funcs.decode = _queue_metric_callback;
+    payload.metrics.arg = &producer;
+    pb_istream_t stream = pb_istream_from_buffer(buffer, length);
+    if (!pb_decode(&stream, Payload_fields, &payload)) return false;
+    if (producer.queued == 0) return true;
+
+    queue->last[(producer.head + queue->count - 1) % queue->count] = true;
+    __atomic_store_n(&(queue->head), producer.head, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool applyNCMDQueue(SparkplugNCMDQueue* queue, DecodeMetricCallback metric_callback, bool staged, size_t* applied) {
+    /*
+    Consumer side, decode and write every queued NCMD, each one all or nothing when staged.
+    Returns false if an NCMD failed or was rejected, applied receives the number of NCMDs taken (optional)
+    */
+    if (applied != NULL) *applied = 0;
+    if (queue == NULL || queue->data == NULL) return false;
+    size_t head = __atomic_load_n(&(queue->head), __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&(queue->tail), __ATOMIC_RELAXED);
+    _NCMDStage* stage = staged ? &(_CTX->ncmd_stage) : NULL;
+    bool result = true;
+
+    // One NCMD per pass, its slots are handed back once it is written
+    while (tail != head) {
+        bool failed = false;
+        if (stage != NULL) _reset_ncmd_stage(stage, false);
+        bool last = false;
+        while (!last && tail != head) {
+            last = queue->last[tail];
+            // Like processNCMD, the rest of an NCMD is dropped after a failed metric
+            if (!failed) {
+                if (!_decode_metric_bytes(&(queue->data[tail * queue->slot_size]), queue->lengths[tail], metric_callback, stage)) failed = true;
+            }
+            tail = (tail + 1) % queue->count;
+        }
+        if (stage != NULL) {
+            size_t written = 0;
+            if (failed) {
+                _reset_ncmd_stage(stage, false);
+            } else if (!_commit_ncmd_stage(stage, metric_callback, &written)) {
+                failed = true;
+            }
+        }
+        if (failed) result = false;
+        if (applied != NULL) (*applied)++;
+        __atomic_store_n(&(queue->tail), tail, __ATOMIC_RELEASE);
+    }
+    return result;
+}
+
+// Context Functions
+
+SparkplugContext* createSparkplugContext(bool own_tags) {
+    /*
+    A context with the same defaults as the default context. With own_tags only the tags added
+    with addSparkplugTag are part of its payloads, otherwise it uses the BasicTag registry
+    */
+    SparkplugContext* context = (SparkplugContext*)malloc(sizeof(SparkplugContext));
+    if (context == NULL) return NULL;
+    memset(context, 0, sizeof(SparkplugContext));
+    context->encode_stream.staging_size = _ENCODE_STAGING_SIZE_DEFAULT;
+    context->iovec_reference_min = _IOVEC_REFERENCE_MIN_DEFAULT;
+    context->own_tags = own_tags;
+    return context;
+}
+
+
+static void _release_context_memory() {
+    clearSparkplugBirthCache();
+    if (_CTX->dirty_tags.indexes != NULL) free(_CTX->dirty_tags.indexes);
+    _CTX->dirty_tags.indexes = NULL;
+    _CTX->dirty_tags.allocated = 0;
+    _CTX->dirty_tags.count = 0;
+    _CTX->dirty_tags.valid = false;
+    if (_CTX->ncmd_stage.writes != NULL) free(_CTX->ncmd_stage.writes);
+    if (_CTX->ncmd_stage.bytes != NULL) free(_CTX->ncmd_stage.bytes);
+    _clear_tag_commands();
+    if (_CTX->scan_classes.order != NULL) free(_CTX->scan_classes.order);
+    _CTX->scan_classes.order = NULL;
+    _CTX->scan_classes.allocated = 0;
+    _CTX->scan_classes.valid = false;
+    _CTX->ncmd_stage.writes = NULL;
+    _CTX->ncmd_stage.allocated = 0;
+    _CTX->ncmd_stage.bytes = NULL;
+    _CTX->ncmd_stage.bytes_allocated = 0;
+    _reset_ncmd_stage(&(_CTX->ncmd_stage), false);
+}
+
+
+void deleteSparkplugContext(SparkplugContext* context) {
+    /*
+    Deletes the node tags made by initializeSparkplugTags and frees the context.
+    Tags added with addSparkplugTag belong to the caller and are not deleted
+    */
+    if (context == NULL || context == &_DEFAULT_CONTEXT) return;
+    SparkplugContext* current = _CTX;
+    _CTX = context;
+    deleteSparkplugTags();
+    _release_context_memory();
+    if (context->encode_stream.staging != NULL) free(context->encode_stream.staging);
+    if (context->tags != NULL) free(context->tags);
+    free(context);
+    _CTX = current != context ? current : &_DEFAULT_CONTEXT;
+}
+
+
+SparkplugContext* getSparkplugContext() {
+    return _CTX;
+}
+
+
+void setSparkplugContext(SparkplugContext* context) {
+    _CTX = context != NULL ? context : &_DEFAULT_CONTEXT;
+}
+
+
+bool addSparkplugTag(FunctionalBasicTag* tag) {
+    /*
+    Add a tag to the current context's tag set. Nothing to do for a context using the BasicTag
+    registry, the tag is already part of it
+    */
+    if (tag == NULL) return false;
+    if (!_CTX->own_tags) return true;
+    for (size_t i = 0; i < _CTX->tags_count; i++) {
+        if (_CTX->tags[i] == tag) return true;
+    }
+    if (_CTX->tags_count == _CTX->tags_allocated) {
+        size_t allocated = _CTX->tags_allocated > 0 ? _CTX->tags_allocated * 2 : 16;
+        FunctionalBasicTag** tags = (FunctionalBasicTag**)realloc(_CTX->tags, allocated * sizeof(FunctionalBasicTag*));
+        if (tags == NULL) return false;
+        _CTX->tags = tags;
+        _CTX->tags_allocated = allocated;
+    }
+    _CTX->tags[_CTX->tags_count] = tag;
+    _CTX->tags_count++;
+    // Positions changed, the next NDATA checks every tag
+    _CTX->dirty_tags.valid = false;
+    _CTX->scan_classes.valid = false;
+    _CTX->tag_index.valid = false;
+    return true;
+}
+
+
+bool removeSparkplugTag(FunctionalBasicTag* tag) {
+    /*
+    Remove a tag, its NCMD handler and scan class from the current context, call it before deleting the tag
+    */
+    if (tag == NULL) return false;
+    setTagCommandCallback(tag, NULL);
+    setTagScanClass(tag, 0);
+    _CTX->tag_index.valid = false;
+    if (!_CTX->own_tags) return true;
+    for (size_t i = 0; i < _CTX->tags_count; i++) {
+        if (_CTX->tags[i] != tag) continue;
+        // Keeps the order of the other tags, the birth cache is rebuilt by the next birth
+        memmove(&(_CTX->tags[i]), &(_CTX->tags[i + 1]), (_CTX->tags_count - i - 1) * sizeof(FunctionalBasicTag*));
+        _CTX->tags_count--;
+        _CTX->dirty_tags.valid = false;
+        _CTX->scan_classes.valid = false;
+        return true;
+    }
+    return false;
+}
+
 // Init Functions
 
-bool setEncodeStream(StreamFunction streamFn) {
+// The last target set is the one payloads are encoded to
+
+bool setEncodeStream(StreamFunction streamFn, void* ctx) {
     if (streamFn == NULL) return false;
-    _ENCODE_STREAM = streamFn;
+    _CTX->encode_stream.write = streamFn;
+    _CTX->encode_stream.ctx = ctx;
+    _CTX->encode_buffer = NULL;
+    return true;
+}
+
+bool setEncodeStreamStagingSize(size_t size) {
+    /*
+    Size of the block writes handed to the StreamFunction. 0 frees the staging memory,
+    every nanopb write then calls the StreamFunction directly
+    */
+    if (_CTX->encode_stream.staging != NULL) free(_CTX->encode_stream.staging);
+    _CTX->encode_stream.staging = NULL;
+    _CTX->encode_stream.staging_size = size;
+    _CTX->encode_stream.staged = 0;
+    return true;
+}
+
+bool setDecodeArena(uint8_t* buffer, size_t size) {
+    /*
+    Scratch memory for decoding NCMD metric names and string/bytes values, NULL to decode on the heap.
+    Must hold the largest metric expected, see SPARKPLUG_DECODE_ARENA_SIZE
+    */
+    if (buffer != NULL && size == 0) return false;
+    _CTX->decode_arena.buffer = buffer;
+    _CTX->decode_arena.size = buffer != NULL ? size : 0;
+    _CTX->decode_arena.used = 0;
     return true;
 }
 
 bool setEncodeBuffer(BufferValue* bufferVal) {
     if (bufferVal == NULL) return false;
-    _ENCODE_BUFFER = bufferVal;
+    _CTX->encode_buffer = bufferVal;
+    _CTX->encode_stream.write = NULL;
+    _CTX->encode_stream.ctx = NULL;
     return true;
 }
 
@@ -611,28 +2961,38 @@ static bool _abort_tags_init(void* ptr_to_check, void* ptr_to_free) {
     return false;
 }
 
+static bool _abort_tag_add(FunctionalBasicTag* tag) {
+    /* adds a created tag to the context, deletes it if that fails */
+    if (addSparkplugTag(tag)) return false;
+    free(tag->value_address);
+    deleteTag(tag);
+    deleteSparkplugTags();
+    return true;
+}
+
+static bool _set_initial_encode_target(BufferValue* bufferVal, StreamFunction streamFn, void* streamCtx) {
+    if (bufferVal != NULL) return setEncodeBuffer(bufferVal);
+    if (streamFn != NULL) return setEncodeStream(streamFn, streamCtx);
+    // No stream or buffer supplied, one must be set already
+    return _CTX->encode_buffer != NULL || _CTX->encode_stream.write != NULL;
+}
+
 
-bool initializeSparkplugTags(BufferValue* bufferVal, StreamFunction streamFn) {
+bool initializeSparkplugTags(BufferValue* bufferVal, StreamFunction streamFn, void* streamCtx) {
     /*
     Create the tags needed for a sparkplug node, bdSeq, Node Control/Rebirth, etc
     Set alias to negative number, this library ignores all tags with negative alias in RBE,
-    and doesn't include the alias in Birth payloads
+    and doesn't include the alias in Birth payloads. Fails while a context of the other kind
+    (registry or own_tags) is initialized
     */
-    if (_NODE_INITIALIZED) return false;
-
-    if (bufferVal != NULL) {
-        if (!setEncodeBuffer(bufferVal)) return false;
-    } else if (streamFn != NULL) {
-        if (!setEncodeStream(streamFn)) return false;
-    } else if (_ENCODE_BUFFER == NULL && _ENCODE_STREAM == NULL) {
-        // No stream or buffer supplied, none is set either
-        return false;
-    }
+    if (_CTX->node_initialized) return false;
+    if (!_tag_set_available()) return false;
+    if (!_set_initial_encode_target(bufferVal, streamFn, streamCtx)) return false;
 
     // Check if tags already exist for memory safety
-    FunctionalBasicTag* bdSeqTag = getTagByName(_bdseq_tag_name);
-    FunctionalBasicTag* rebirthTag = getTagByName(_rebirth_tag_name);
-    FunctionalBasicTag* scanRateTag = getTagByName(_scan_rate_tag_name);
+    FunctionalBasicTag* bdSeqTag = findSparkplugTagByName(_bdseq_tag_name);
+    FunctionalBasicTag* rebirthTag = findSparkplugTagByName(_rebirth_tag_name);
+    FunctionalBasicTag* scanRateTag = findSparkplugTagByName(_scan_rate_tag_name);
     if (bdSeqTag != NULL || rebirthTag != NULL || scanRateTag != NULL) return false;
      
     int64_t* bdSeq_value = (int64_t*)malloc(sizeof(int64_t));
@@ -640,6 +3000,7 @@ bool initializeSparkplugTags(BufferValue* bufferVal, StreamFunction streamFn) {
     *bdSeq_value = _get_bdseq_default();
     bdSeqTag = createInt64Tag(_bdseq_tag_name, bdSeq_value, _bdseq_tag_alias, false, false);
     if (_abort_tags_init(bdSeqTag, bdSeq_value)) return false;
+    if (_abort_tag_add(bdSeqTag)) return false;
 
 
     // Create Node Control/Rebirth
@@ -648,6 +3009,7 @@ bool initializeSparkplugTags(BufferValue* bufferVal, StreamFunction streamFn) {
     *rebirth_value = false;
     rebirthTag = createBoolTag(_rebirth_tag_name, rebirth_value, _rebirth_tag_alias, false, true);
     if (_abort_tags_init(rebirthTag, rebirth_value)) return false;
+    if (_abort_tag_add(rebirthTag)) return false;
 
 
     // Create Scan Rate
@@ -656,49 +3018,324 @@ bool initializeSparkplugTags(BufferValue* bufferVal, StreamFunction streamFn) {
     *scan_rate_value = _get_scan_rate_default();
     scanRateTag = createInt64Tag(_scan_rate_tag_name, scan_rate_value, -901, false, true);
     if (_abort_tags_init(scanRateTag, scan_rate_value)) return false;
+    if (_abort_tag_add(scanRateTag)) return false;
     scanRateTag->validateWrite = _default_validate_scan_rate;
 
-    _NODE_INITIALIZED = true;
+    _CTX->node_initialized = true;
+    _count_initialized_context(true);
+    return true;
+}
+
+
+bool initializeSparkplugDevice(BufferValue* bufferVal, StreamFunction streamFn, void* streamCtx) {
+    /*
+    Set up the current context for a device, its births and data payloads are made with the NBIRTH and
+    NDATA functions. Only the encode target is set, a device has none of the node's tags
+    */
+    if (_CTX->node_initialized) return false;
+    if (!_tag_set_available()) return false;
+    if (!_set_initial_encode_target(bufferVal, streamFn, streamCtx)) return false;
+    _CTX->device = true;
+    _CTX->node_initialized = true;
+    _count_initialized_context(true);
     return true;
 }
 
 
 bool deleteSparkplugTags() {
-    if (!_NODE_INITIALIZED) return false;
+    if (!_CTX->node_initialized) return false;
+    if (_CTX->device) {
+        // Nothing created by initializeSparkplugDevice, the device's tags belong to the caller
+        _release_context_memory();
+        _CTX->device = false;
+        _CTX->node_initialized = false;
+        _count_initialized_context(false);
+        return true;
+    }
     // deallocate the tag's value_address, then call deleteBasicTag
-    FunctionalBasicTag* bdSeqTag = getTagByName(_bdseq_tag_name);
+    FunctionalBasicTag* bdSeqTag = findSparkplugTagByName(_bdseq_tag_name);
     if (bdSeqTag != NULL) {
+        removeSparkplugTag(bdSeqTag);
         free(bdSeqTag->value_address);
         deleteTag(bdSeqTag);
     }
-    FunctionalBasicTag* rebirthTag = getTagByName(_rebirth_tag_name);
+    FunctionalBasicTag* rebirthTag = findSparkplugTagByName(_rebirth_tag_name);
     if (rebirthTag != NULL) {
+        removeSparkplugTag(rebirthTag);
         free(rebirthTag->value_address);
         deleteTag(rebirthTag);
     }
-    FunctionalBasicTag* scanRateTag = getTagByName(_scan_rate_tag_name);
+    FunctionalBasicTag* scanRateTag = findSparkplugTagByName(_scan_rate_tag_name);
     if (scanRateTag != NULL) {
+        removeSparkplugTag(scanRateTag);
         free(scanRateTag->value_address);
         deleteTag(scanRateTag);
     }
-    _NODE_INITIALIZED = false;
+    _release_context_memory();
+    _CTX->node_initialized = false;
+    _count_initialized_context(false);
+    return true;
+}
+
+
+static void _start_tag_read(size_t count) {
+    // A scan starts a new changed tag list and a new NDATA
+    _CTX->dirty_tags.count = 0;
+    _CTX->dirty_tags.valid = true;
+    _CTX->ndata_split.next = 0;
+    _CTX->ndata_split.pending = false;
+    if (count > _CTX->dirty_tags.allocated) {
+        size_t* indexes = (size_t*)realloc(_CTX->dirty_tags.indexes, count * sizeof(size_t));
+        if (indexes != NULL) {
+            _CTX->dirty_tags.indexes = indexes;
+            _CTX->dirty_tags.allocated = count;
+        } else {
+            // Can't hold the list, the next NDATA checks every tag
+            _CTX->dirty_tags.valid = false;
+        }
+    }
+}
+
+
+static bool _read_tag(FunctionalBasicTag* tag_ptr, size_t idx, uint64_t timestamp) {
+    readBasicTag(tag_ptr, timestamp);
+    if (!(tag_ptr->valueChanged)) return false;
+    // Tags in the ignored alias range are never part of an NDATA
+    if (_CTX->dirty_tags.valid && tag_ptr->alias >= -999) {
+        _CTX->dirty_tags.indexes[_CTX->dirty_tags.count] = idx;
+        _CTX->dirty_tags.count++;
+    }
+    return true;
+}
+
+
+static bool _scan_classes_valid(size_t count) {
+    _ScanClasses* classes = &(_CTX->scan_classes);
+    if (!(classes->valid) || classes->tags_count != count) return false;
+    // An own_tags set only changes through addSparkplugTag and removeSparkplugTag, which drop the
+    // list. Registry positions shift when tags are created or deleted, even if the count is the same
+    if (_CTX->own_tags) return true;
+    for (size_t k = 0; k < count; k++) {
+        if (_tag_at(classes->order[k].index) != classes->order[k].tag) return false;
+    }
+    return true;
+}
+
+
+static bool _build_scan_classes(size_t count) {
+    /* Groups the tags by scan class, a counting sort over the tag set */
+    _ScanClasses* classes = &(_CTX->scan_classes);
+    if (count > classes->allocated) {
+        _ScanClassEntry* order = (_ScanClassEntry*)realloc(classes->order, count * sizeof(_ScanClassEntry));
+        if (order == NULL) return false;
+        classes->order = order;
+        classes->allocated = count;
+    }
+    size_t next[SPARKPLUG_SCAN_CLASSES + 1] = {0};
+    for (size_t i = 0; i < count; i++) next[getTagScanClass(_tag_at(i)) + 1]++;
+    for (size_t n = 1; n <= SPARKPLUG_SCAN_CLASSES; n++) next[n] += next[n - 1];
+    memcpy(classes->starts, next, sizeof(next));
+    for (size_t i = 0; i < count; i++) {
+        FunctionalBasicTag* tag_ptr = _tag_at(i);
+        _ScanClassEntry* entry = &(classes->order[next[getTagScanClass(tag_ptr)]++]);
+        entry->tag = tag_ptr;
+        entry->index = i;
+    }
+    classes->tags_count = count;
+    classes->valid = true;
+    return true;
+}
+
+
+bool readSparkplugTags(uint64_t timestamp) {
+    /*
+    Read every tag like readAllBasicTags, recording the tags that changed for the next NDATA.
+    Returns true if any tag value changed.
+    */
+    return readSparkplugTagClasses(SPARKPLUG_ALL_SCAN_CLASSES, timestamp);
+}
+
+
+bool readSparkplugTagClasses(uint32_t scan_classes, uint64_t timestamp) {
+    /*
+    Read the tags of the scan classes set in scan_classes, recording the tags that changed for the
+    next NDATA. The other tags aren't read, so slow classes cost nothing between their scans.
+    Returns true if any tag value changed.
+    */
+    size_t count = _tags_count();
+    bool values_changed = false;
+    _start_tag_read(count);
+
+    _ScanClasses* classes = &(_CTX->scan_classes);
+    bool every_tag = (scan_classes & SPARKPLUG_ALL_SCAN_CLASSES) == SPARKPLUG_ALL_SCAN_CLASSES;
+    if (!every_tag && !_scan_classes_valid(count) && !_build_scan_classes(count)) {
+        // Can't group the tags, read them all
+        every_tag = true;
+    }
+
+    if (every_tag) {
+        for (size_t i = 0; i < count; i++) {
+            if (_read_tag(_tag_at(i), i, timestamp)) values_changed = true;
+        }
+    } else {
+        for (size_t n = 0; n < SPARKPLUG_SCAN_CLASSES; n++) {
+            bool due = scan_classes & (1UL << n);
+            for (size_t k = classes->starts[n]; k < classes->starts[n + 1]; k++) {
+                _ScanClassEntry* entry = &(classes->order[k]);
+                if (due) {
+                    if (_read_tag(entry->tag, entry->index, timestamp)) values_changed = true;
+                } else {
+                    // Not read, so not part of this scan's changes even when the NDATA checks every tag
+                    entry->tag->valueChanged = false;
+                }
+            }
+        }
+    }
+    _CTX->dirty_tags.tags_count = count;
+    return values_changed;
+}
+
+
+bool buildSparkplugBirthCache() {
+    /*
+    Pre-encode the name, alias and datatype fields of every registered tag for NBIRTH and NDATA payloads.
+    Called automatically by each birth, call it after creating tags to move the work out of the first birth.
+    Also builds the name and alias index used to resolve NCMD metrics.
+    */
+    if (_birth_cache_valid()) {
+        if (!_tag_index_current()) _build_tag_index();
+        return true;
+    }
+
+    size_t count = _tags_count();
+    size_t bytes_needed = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes_needed += _birth_head_size(_tag_at(i));
+    }
+    // A birth being sent in fragments was made from the old tag set
+    _CTX->nbirth_fragments.active = false;
+
+    if (count > _CTX->birth_cache.entries_allocated) {
+        _BirthCacheEntry* entries = (_BirthCacheEntry*)realloc(_CTX->birth_cache.entries, count * sizeof(_BirthCacheEntry));
+        if (entries == NULL) {
+            clearSparkplugBirthCache();
+            return false;
+        }
+        _CTX->birth_cache.entries = entries;
+        _CTX->birth_cache.entries_allocated = count;
+    }
+    if (bytes_needed > _CTX->birth_cache.bytes_allocated) {
+        uint8_t* bytes = (uint8_t*)realloc(_CTX->birth_cache.bytes, bytes_needed);
+        if (bytes == NULL) {
+            clearSparkplugBirthCache();
+            return false;
+        }
+        _CTX->birth_cache.bytes = bytes;
+        _CTX->birth_cache.bytes_allocated = bytes_needed;
+    }
+
+    // Left empty if encoding fails part way
+    _CTX->birth_cache.count = 0;
+    pb_ostream_t stream = pb_ostream_from_buffer(_CTX->birth_cache.bytes, _CTX->birth_cache.bytes_allocated);
+    for (size_t i = 0; i < count; i++) {
+        FunctionalBasicTag* tag_ptr = _tag_at(i);
+        _BirthCacheEntry* entry = &(_CTX->birth_cache.entries[i]);
+        entry->tag = tag_ptr;
+        entry->name = tag_ptr->name;
+        entry->alias = tag_ptr->alias;
+        entry->offset = stream.bytes_written;
+
+        if (!pb_encode_tag(&stream, PB_WT_STRING, Payload_Metric_name_tag)) return false;
+        if (!pb_encode_string(&stream, (const pb_byte_t*)(tag_ptr->name), strlen(tag_ptr->name))) return false;
+        // NDATA payloads carry only the alias, or the name when there is none
+        entry->data_offset = tag_ptr->alias > -1 ? stream.bytes_written : entry->offset;
+        if (tag_ptr->alias > -1) {
+            if (!pb_encode_tag(&stream, PB_WT_VARINT, Payload_Metric_alias_tag)) return false;
+            if (!pb_encode_varint(&stream, (uint64_t)(tag_ptr->alias))) return false;
+        }
+        entry->length = stream.bytes_written - entry->offset;
+
+        entry->datatype = tag_ptr->datatype;
+        pb_ostream_t datatype_stream = pb_ostream_from_buffer(entry->datatype_field, sizeof(entry->datatype_field));
+        if (!pb_encode_tag(&datatype_stream, PB_WT_VARINT, Payload_Metric_datatype_tag)) return false;
+        if (!pb_encode_varint(&datatype_stream, (uint32_t)(tag_ptr->datatype))) return false;
+        entry->datatype_field_length = (uint8_t)datatype_stream.bytes_written;
+    }
+    _CTX->birth_cache.count = count;
+    // Built after the cache, a failed index is built again by the next lookup
+    _build_tag_index();
     return true;
 }
 
 
+void clearSparkplugBirthCache() {
+    if (_CTX->birth_cache.entries != NULL) free(_CTX->birth_cache.entries);
+    if (_CTX->birth_cache.bytes != NULL) free(_CTX->birth_cache.bytes);
+    _CTX->birth_cache.entries = NULL;
+    _CTX->birth_cache.entries_allocated = 0;
+    _CTX->birth_cache.count = 0;
+    _CTX->birth_cache.bytes = NULL;
+    _CTX->birth_cache.bytes_allocated = 0;
+    if (_CTX->birth_cache.frozen != NULL) free(_CTX->birth_cache.frozen);
+    if (_CTX->birth_cache.frozen_bytes != NULL) free(_CTX->birth_cache.frozen_bytes);
+    _CTX->birth_cache.frozen = NULL;
+    _CTX->birth_cache.frozen_allocated = 0;
+    _CTX->birth_cache.frozen_bytes = NULL;
+    _CTX->birth_cache.frozen_bytes_allocated = 0;
+    _CTX->nbirth_fragments.active = false;
+    _clear_tag_index();
+}
+
+
 bool sparkplugInitialized() {
-    return _NODE_INITIALIZED;
+    return _CTX->node_initialized;
 }
 
 // Special getTag functions
+bool setTagCommandCallback(FunctionalBasicTag* tag, DecodeMetricCallback on_cmd_callback) {
+    /*
+    Handle the NCMD metrics of tag with on_cmd_callback instead of the default writer, NULL removes it.
+    Remove a tag's handler before deleting the tag
+    */
+    if (tag == NULL) return false;
+    SparkplugTagData* entry = _tag_data(tag, on_cmd_callback != NULL);
+    if (entry == NULL) return on_cmd_callback == NULL;
+    entry->on_cmd_callback = on_cmd_callback;
+    return true;
+}
+
+DecodeMetricCallback getTagCommandCallback(FunctionalBasicTag* tag) {
+    if (tag == NULL) return NULL;
+    return _tag_command_callback(tag);
+}
+
+bool setTagScanClass(FunctionalBasicTag* tag, uint8_t scan_class) {
+    /*
+    Put tag in scan_class, read by readSparkplugTagClasses when that class is given. Every tag
+    starts in class 0
+    */
+    if (tag == NULL || scan_class >= SPARKPLUG_SCAN_CLASSES) return false;
+    SparkplugTagData* entry = _tag_data(tag, scan_class != 0);
+    if (entry == NULL) return scan_class == 0;
+    if (entry->scan_class != scan_class) _CTX->scan_classes.valid = false;
+    entry->scan_class = scan_class;
+    return true;
+}
+
+uint8_t getTagScanClass(FunctionalBasicTag* tag) {
+    if (tag == NULL) return 0;
+    SparkplugTagData* entry = _tag_data(tag, false);
+    return entry != NULL ? entry->scan_class : 0;
+}
+
 FunctionalBasicTag* getBdSeqTag() {
-    return getTagByName(_bdseq_tag_name);
+    return findSparkplugTagByName(_bdseq_tag_name);
 }
 FunctionalBasicTag* getRebirthTag() {
-    return getTagByName(_rebirth_tag_name);
+    return findSparkplugTagByName(_rebirth_tag_name);
 }
 FunctionalBasicTag* getScanRateTag() {
-    return getTagByName(_scan_rate_tag_name);
+    return findSparkplugTagByName(_scan_rate_tag_name);
 }
 
 
@@ -27,15 +27,65 @@ extern "C" {
 #include <BasicTag.h>
 
 
-typedef void (*StreamFunction)(uint8_t* byte_ptr, size_t length);
+// Writes length bytes to the stream, ctx is the pointer given with the function. Returns false to abort the encode
+typedef bool (*StreamFunction)(const uint8_t* byte_ptr, size_t length, void* ctx);
+// Scatter-gather output entry, same layout as struct iovec so a list can be passed to writev/sendmsg
+typedef struct {
+    void* base;
+    size_t length;
+} SparkplugIOVec;
+
+typedef struct {
+    SparkplugIOVec* vecs;  // Supplied by the caller
+    size_t allocated_count;
+    size_t count;
+    size_t total_length;  // Encoded payload length, sum of the entry lengths
+} SparkplugIOVecList;
+
+// Encoder state, caches and NCMD state of one node, see setSparkplugContext
+typedef struct SparkplugContext SparkplugContext;
+
 typedef int (*DecodeMetricCallback)(BasicValue* valueReceived, FunctionalBasicTag* matchedTag); // for custom behaviour
 
-// Wrapper for FunctionalBasicTag to hold tag specific encode/decode config
-// Potentially added in v1.1.0
-/*typedef struct SparkplugTagData SparkplugTagData;
+// Decoder state for an NCMD fed in chunks, set up by initNCMDStream
+typedef struct {
+    uint8_t* buffer;  // Holds one metric at a time, must fit the largest metric
+    size_t size;
+    DecodeMetricCallback callback;
+    bool staged;  // All or nothing, as processNCMDStaged
+    // Position in the NCMD, managed by the decoder
+    size_t used;
+    size_t remaining;
+    uint64_t varint;
+    uint8_t varint_shift;
+    uint32_t field;
+    uint8_t state;
+    bool started;
+    bool failed;
+} SparkplugNCMDStream;
+
+// Single producer, single consumer queue of NCMD metrics, set up by initNCMDQueue
+typedef struct {
+    uint8_t* data;  // count slots of slot_size bytes, each holds one encoded metric
+    size_t* lengths;
+    bool* last;  // Set on the last metric of each NCMD
+    size_t count;
+    size_t slot_size;
+    size_t head;  // Only moved by queueNCMD
+    size_t tail;  // Only moved by applyNCMDQueue
+} SparkplugNCMDQueue;
+
+// Tag specific config, set with setTagCommandCallback and setTagScanClass
+typedef struct SparkplugTagData SparkplugTagData;
 struct SparkplugTagData {
+    FunctionalBasicTag* tag;
     DecodeMetricCallback on_cmd_callback;
-};*/
+    uint8_t scan_class;
+};
+
+// Scan classes 0 to SPARKPLUG_SCAN_CLASSES - 1, a tag is in class 0 until setTagScanClass moves it
+#define SPARKPLUG_SCAN_CLASSES 8
+#define SPARKPLUG_ALL_SCAN_CLASSES ((1UL << SPARKPLUG_SCAN_CLASSES) - 1)
 
 int encodeDataPayload(BufferValue* buffer);
 
@@ -47,19 +97,66 @@ int decodePayload(BufferValue* buffer);
 
 
 // These functions are for custom payloads or custom stream/buffer
-bool encodePayloadToStream(Payload* payload, StreamFunction streamFn);
+bool encodePayloadToStream(Payload* payload, StreamFunction streamFn, void* ctx);
 bool encodePayloadToBuffer(Payload* payload, BufferValue* buffer);
 
 
+// Context Functions. Every other function works on the current context, the default context
+// until another is selected. Build with SPARKPLUG_THREAD_LOCAL_CONTEXT to select contexts per thread
+
+// With own_tags the context only uses the tags added to it, otherwise every tag in the BasicTag registry.
+// The registry includes the tags of own_tags contexts, so the two kinds can't be initialized at the same time
+SparkplugContext* createSparkplugContext(bool own_tags);
+void deleteSparkplugContext(SparkplugContext* context);
+SparkplugContext* getSparkplugContext();
+void setSparkplugContext(SparkplugContext* context);  // NULL selects the default context
+bool addSparkplugTag(FunctionalBasicTag* tag);
+bool removeSparkplugTag(FunctionalBasicTag* tag);  // Call before deleting a tag
+
+
 // Init Functions
 
-bool setEncodeStream(StreamFunction streamFn);
+bool setEncodeStream(StreamFunction streamFn, void* ctx);
+// Stream writes are coalesced into blocks of this size (default 256), 0 disables staging
+bool setEncodeStreamStagingSize(size_t size);
 bool setEncodeBuffer(BufferValue* bufferVal);
 
-bool initializeSparkplugTags(BufferValue* bufferVal, StreamFunction streamFn);
+// Arena size for the largest metric within the incoming name and value limits (1024 bytes each)
+#define SPARKPLUG_DECODE_ARENA_SIZE 2112
+// NCMD names and string/bytes values are decoded into buffer instead of the heap, NULL to use the heap again
+bool setDecodeArena(uint8_t* buffer, size_t size);
+
+bool initializeSparkplugTags(BufferValue* bufferVal, StreamFunction streamFn, void* streamCtx);
 bool deleteSparkplugTags(); // Deallocate the tags
+// Sets up the current context for a Sparkplug device, see makeDDEATH
+bool initializeSparkplugDevice(BufferValue* bufferVal, StreamFunction streamFn, void* streamCtx);
 bool sparkplugInitialized();
 
+// Read all tags, recording which changed so the next NDATA only visits those
+bool readSparkplugTags(uint64_t timestamp);
+// Same for the tags of the scan classes in the scan_classes bit mask (bit n is class n)
+bool readSparkplugTagClasses(uint32_t scan_classes, uint64_t timestamp);
+
+// Birth cache, pre-encoded metric names and aliases reused by every NBIRTH
+
+bool buildSparkplugBirthCache();
+void clearSparkplugBirthCache();
+
+// Tag lookup through the name and alias index built with the birth cache
+
+FunctionalBasicTag* findSparkplugTagByName(const char* name);
+FunctionalBasicTag* findSparkplugTagByAlias(int alias);
+
+// Per-tag NCMD handlers, take precedence over the callback given to processNCMD and the default writer.
+// Whichever NCMD function runs them, String, Text and UUID values reach them as NUL terminated
+// valueReceived->value.stringValue, and Bytes values as a BufferValue, valid until the handler returns
+
+bool setTagCommandCallback(FunctionalBasicTag* tag, DecodeMetricCallback on_cmd_callback);
+DecodeMetricCallback getTagCommandCallback(FunctionalBasicTag* tag);
+
+bool setTagScanClass(FunctionalBasicTag* tag, uint8_t scan_class);
+uint8_t getTagScanClass(FunctionalBasicTag* tag);
+
 // Special getTag functions
 
 FunctionalBasicTag* getBdSeqTag();
@@ -70,13 +167,61 @@ FunctionalBasicTag* getScanRateTag();
 
 bool makeNDEATH(uint64_t timestamp);
 bool makeNBIRTH(uint64_t timestamp, int sequence);
-bool makeHistoricalNDATA(uint64_t timestamp, int sequence);
+bool makeHistoricalNBIRTH(uint64_t timestamp, int sequence);
 bool makeNDATA(uint64_t timestamp, int sequence);
 bool makeHistoricalNDATA(uint64_t timestamp, int sequence);
+// On a device context the NBIRTH and NDATA functions make the DBIRTH and DDATA payloads
+bool makeDDEATH(uint64_t timestamp, int sequence);
+
+// Exact encoded length of the payload the matching make function would produce now, 0 on failure.
+// NDATA sizes reflect the values read by the last scan
+size_t getNBIRTHSize(uint64_t timestamp, int sequence);
+size_t getHistoricalNBIRTHSize(uint64_t timestamp, int sequence);
+size_t getNDATASize(uint64_t timestamp, int sequence);
+size_t getHistoricalNDATASize(uint64_t timestamp, int sequence);
+
+// Payloads larger than the encode buffer (buffer only, not stream)
+
+// NDATA split over several payloads, call again while morePending is true. A new readSparkplugTags starts a new NDATA
+bool makeNDATAPart(uint64_t timestamp, int sequence, bool* morePending);
+bool makeHistoricalNDATAPart(uint64_t timestamp, int sequence, bool* morePending);
+// Bytes [offset, offset + buffer length) of a single NBIRTH. The call with offset 0 sets totalLength and
+// takes the tag values of every fragment, later calls must pass the same timestamp, sequence and totalLength
+bool makeNBIRTHFragment(uint64_t timestamp, int sequence, size_t offset, size_t* totalLength);
+bool makeHistoricalNBIRTHFragment(uint64_t timestamp, int sequence, size_t offset, size_t* totalLength);
+
+// Payload as an iovec list. Framing goes to the encode buffer, string and bytes values of at least
+// the threshold length (default 128) are referenced from the tags and must not change until sent
+bool makeNBIRTHIOVec(uint64_t timestamp, int sequence, SparkplugIOVecList* iov);
+bool makeHistoricalNBIRTHIOVec(uint64_t timestamp, int sequence, SparkplugIOVecList* iov);
+bool makeNDATAIOVec(uint64_t timestamp, int sequence, SparkplugIOVecList* iov);
+bool makeHistoricalNDATAIOVec(uint64_t timestamp, int sequence, SparkplugIOVecList* iov);
+void setIOVecReferenceThreshold(size_t minLength);
 
 // decode functions
 
 bool processNCMD(uint8_t* buffer, size_t length, DecodeMetricCallback metric_callback);
+// String and bytes values reach metric_callback as views into buffer (valueReceived->value.bytesValue,
+// strings are not NUL terminated), valid until the callback returns
+bool processNCMDViews(uint8_t* buffer, size_t length, DecodeMetricCallback metric_callback);
+// All or nothing, every metric is checked before any is written. Fails without writing on an unknown
+// or read only tag, a datatype mismatch or a validateWrite rejection. written is optional.
+// metric_callback gets values as from processNCMD, strings NUL terminated, as do streams and the queue
+bool processNCMDStaged(uint8_t* buffer, size_t length, DecodeMetricCallback metric_callback, size_t* written);
+
+// NCMD decoding from chunks, for messages read from the network without reassembling them.
+// Feed every chunk in order then call finishNCMDStream, which also resets the stream for the next NCMD
+bool initNCMDStream(SparkplugNCMDStream* ncmd_stream, uint8_t* buffer, size_t size, DecodeMetricCallback metric_callback, bool staged);
+void resetNCMDStream(SparkplugNCMDStream* ncmd_stream);
+bool feedNCMDStream(SparkplugNCMDStream* ncmd_stream, const uint8_t* chunk, size_t length);
+bool finishNCMDStream(SparkplugNCMDStream* ncmd_stream, size_t* written);
+
+// NCMD queue. queueNCMD may run in another task than the tags' (e.g. the MQTT client's), it only
+// copies the metrics into the queue. applyNCMDQueue decodes and writes them in the tags' task
+bool initNCMDQueue(SparkplugNCMDQueue* queue, size_t length, size_t slot_size);
+void freeNCMDQueue(SparkplugNCMDQueue* queue);
+bool queueNCMD(SparkplugNCMDQueue* queue, const uint8_t* buffer, size_t length);
+bool applyNCMDQueue(SparkplugNCMDQueue* queue, DecodeMetricCallback metric_callback, bool staged, size_t* applied);
 
 
 
@@ -0,0 +1,679 @@
+/*
+Copyright 2024 Michael Keras.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#if defined(__unix__) && !defined(__APPLE__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "SparkplugHistory.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+void closeHistoryStore(SparkplugHistoryStore* store) {
+    if (store == NULL) return;
+    store->close(store);
+}
+
+
+/*
+Memory store
+
+A byte ring of records, each framed by its length (4 bytes). A full ring either rejects the new
+record or drops the oldest records until it fits.
+*/
+
+#define _MEMORY_RECORD_HEADER_SIZE 4
+
+typedef struct {
+    SparkplugHistoryStore store;  // First, so the store is the _MemoryStore
+    uint8_t* data;
+    size_t size;
+    size_t head;  // Where the next record is written
+    size_t tail;  // Start of the oldest record
+    size_t used;
+    size_t count;  // Records held
+    SparkplugHistoryOverflow overflow;
+} _MemoryStore;
+
+static void _ring_write(_MemoryStore* ring, const uint8_t* bytes, size_t length) {
+    size_t first = ring->size - ring->head;
+    if (first > length) first = length;
+    memcpy(&(ring->data[ring->head]), bytes, first);
+    if (length > first) memcpy(ring->data, &bytes[first], length - first);
+    ring->head = (ring->head + length) % ring->size;
+    ring->used += length;
+}
+
+static void _ring_read(const _MemoryStore* ring, size_t offset, uint8_t* bytes, size_t length) {
+    // Reads from offset bytes into the ring's oldest data, it stays in the ring
+    size_t start = (ring->tail + offset) % ring->size;
+    size_t first = ring->size - start;
+    if (first > length) first = length;
+    memcpy(bytes, &(ring->data[start]), first);
+    if (length > first) memcpy(&bytes[first], ring->data, length - first);
+}
+
+static size_t _memory_oldest(SparkplugHistoryStore* store) {
+    _MemoryStore* ring = (_MemoryStore*)store;
+    if (ring->count == 0) return 0;
+    uint32_t length;
+    _ring_read(ring, 0, (uint8_t*)&length, sizeof(length));
+    return length;
+}
+
+static bool _memory_read(SparkplugHistoryStore* store, size_t offset, uint8_t* bytes, size_t length) {
+    _MemoryStore* ring = (_MemoryStore*)store;
+    size_t record_length = _memory_oldest(store);
+    if (offset + length > record_length) return false;
+    _ring_read(ring, _MEMORY_RECORD_HEADER_SIZE + offset, bytes, length);
+    return true;
+}
+
+static bool _memory_drop(SparkplugHistoryStore* store) {
+    _MemoryStore* ring = (_MemoryStore*)store;
+    if (ring->count == 0) return false;
+    size_t record_length = _MEMORY_RECORD_HEADER_SIZE + _memory_oldest(store);
+    ring->tail = (ring->tail + record_length) % ring->size;
+    ring->used -= record_length;
+    ring->count--;
+    return true;
+}
+
+static bool _memory_append(SparkplugHistoryStore* store, const uint8_t* head, size_t head_length, const uint8_t* body, size_t body_length) {
+    _MemoryStore* ring = (_MemoryStore*)store;
+    size_t length = head_length + body_length;
+    size_t record_length = _MEMORY_RECORD_HEADER_SIZE + length;
+    if (length == 0 || length > UINT32_MAX || record_length > ring->size) return false;
+    if (ring->used + record_length > ring->size) {
+        if (ring->overflow == spn_HISTORY_DROP_NEWEST) return false;
+        while (ring->used + record_length > ring->size) {
+            _memory_drop(store);
+            store->dropped++;
+        }
+    }
+
+    uint32_t header = (uint32_t)length;
+    _ring_write(ring, (const uint8_t*)&header, _MEMORY_RECORD_HEADER_SIZE);
+    if (head_length > 0) _ring_write(ring, head, head_length);
+    if (body_length > 0) _ring_write(ring, body, body_length);
+    ring->count++;
+    return true;
+}
+
+static void _memory_close(SparkplugHistoryStore* store) {
+    _MemoryStore* ring = (_MemoryStore*)store;
+    free(ring->data);
+    free(ring);
+}
+
+SparkplugHistoryStore* createMemoryHistoryStore(size_t size, SparkplugHistoryOverflow overflow) {
+    if (size <= _MEMORY_RECORD_HEADER_SIZE) return NULL;
+    _MemoryStore* ring = (_MemoryStore*)calloc(1, sizeof(_MemoryStore));
+    if (ring == NULL) return NULL;
+    ring->data = (uint8_t*)malloc(size);
+    if (ring->data == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->size = size;
+    ring->overflow = overflow;
+    ring->store.append = _memory_append;
+    ring->store.oldest = _memory_oldest;
+    ring->store.read = _memory_read;
+    ring->store.drop = _memory_drop;
+    ring->store.close = _memory_close;
+    return &(ring->store);
+}
+
+
+SparkplugFileHistoryOptions defaultFileHistoryOptions(const char* directory) {
+    SparkplugFileHistoryOptions options;
+    options.directory = directory;
+    options.segment_size = 1024 * 1024;
+    options.segment_count = 64;
+    options.overflow = spn_HISTORY_DROP_OLDEST;
+    options.use_mmap = false;
+    options.sync_interval = 1;
+    options.checkpoint_interval = 16;
+    return options;
+}
+
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+File store
+
+An append-only log split into fixed size segment files named by their id ("0000002a.seg"). A
+record is a 16 byte header (magic, segment id, length, CRC-32 of the id, length and data, all
+little endian) followed by its data. Records are only ever appended, so after a crash or power loss
+the log ends at the first record whose header or CRC doesn't check out, which is where writing
+resumes. The segment id in each record keeps the old records of a recycled file from being read.
+
+The read position (segment id and offset) is checkpointed to the "cursor" file, written to
+"cursor.tmp" then renamed over it, every checkpoint_interval dropped records and whenever the read
+position leaves a segment. Records dropped after the last checkpoint are replayed again after a
+restart, nothing is lost. Segments behind the cursor are kept as spares and renamed to the next id
+when the log needs a new segment, so a long running gateway reuses the same files.
+*/
+
+#define _FILE_RECORD_HEADER_SIZE 16
+#define _FILE_RECORD_MAGIC 0x4752504bUL
+#define _FILE_CURSOR_MAGIC 0x5252434bUL
+#define _FILE_CURSOR_SIZE 16
+#define _FILE_SEGMENT_NAME_LENGTH 12  // 8 hex digits and ".seg"
+
+typedef struct {
+    uint32_t id;
+    int fd;  // -1 when closed
+    uint8_t* map;  // Whole segment when use_mmap
+} _Segment;
+
+typedef struct {
+    SparkplugHistoryStore store;  // First, so the store is the _FileStore
+    SparkplugFileHistoryOptions options;
+    char* directory;
+    char* path;  // Scratch for file paths
+    char* path_2;
+    size_t path_size;
+    _Segment write_segment;
+    _Segment read_segment;  // Only used while reading a segment before the write segment
+    uint32_t write_id;
+    size_t write_offset;
+    uint32_t read_id;
+    size_t read_offset;
+    size_t oldest_length;  // Cached length of the record at the read position, 0 when unknown
+    uint32_t* spares;  // Ids of the segment files behind the cursor
+    size_t spares_count;
+    size_t appends_since_sync;
+    size_t drops_since_checkpoint;
+} _FileStore;
+
+static uint32_t _crc32_update(uint32_t crc, const uint8_t* bytes, size_t length) {
+    // Reflected 0xEDB88320 a nibble at a time, small enough for any target
+    static const uint32_t table[16] = {
+        0x00000000UL, 0x1db71064UL, 0x3b6e20c8UL, 0x26d930acUL, 0x76dc4190UL, 0x6b6b51f4UL, 0x4db26158UL, 0x5005713cUL,
+        0xedb88320UL, 0xf00f9344UL, 0xd6d6a3e8UL, 0xcb61b38cUL, 0x9b64c2b0UL, 0x86d3d2d4UL, 0xa00ae278UL, 0xbdbdf21cUL
+    };
+    for (size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+        crc = (crc >> 4) ^ table[crc & 0x0f];
+    }
+    return crc;
+}
+
+static void _put_u32(uint8_t* bytes, uint32_t value) {
+    bytes[0] = (uint8_t)value;
+    bytes[1] = (uint8_t)(value >> 8);
+    bytes[2] = (uint8_t)(value >> 16);
+    bytes[3] = (uint8_t)(value >> 24);
+}
+
+static uint32_t _get_u32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static bool _pread_all(int fd, uint8_t* bytes, size_t length, size_t offset) {
+    while (length > 0) {
+        ssize_t count = pread(fd, bytes, length, (off_t)offset);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        offset += (size_t)count;
+        length -= (size_t)count;
+    }
+    return true;
+}
+
+static bool _pwrite_all(int fd, const uint8_t* bytes, size_t length, size_t offset) {
+    while (length > 0) {
+        ssize_t count = pwrite(fd, bytes, length, (off_t)offset);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        offset += (size_t)count;
+        length -= (size_t)count;
+    }
+    return true;
+}
+
+static const char* _file_path(_FileStore* file, char* path, const char* name) {
+    snprintf(path, file->path_size, "%s/%s", file->directory, name);
+    return path;
+}
+
+static const char* _segment_path(_FileStore* file, char* path, uint32_t id) {
+    snprintf(path, file->path_size, "%s/%08lx.seg", file->directory, (unsigned long)id);
+    return path;
+}
+
+static void _sync_directory(_FileStore* file) {
+    // Makes creates and renames in the directory durable
+    int fd = open(file->directory, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+
+// Segment Functions
+
+static void _close_segment(_FileStore* file, _Segment* segment) {
+    if (segment->map != NULL) munmap(segment->map, file->options.segment_size);
+    if (segment->fd >= 0) close(segment->fd);
+    segment->map = NULL;
+    segment->fd = -1;
+}
+
+static bool _open_segment(_FileStore* file, _Segment* segment, uint32_t id, bool create) {
+    _close_segment(file, segment);
+    int flags = O_RDWR | (create ? O_CREAT : 0);
+    int fd = open(_segment_path(file, file->path, id), flags, 0644);
+    if (fd < 0) return false;
+    if (file->options.use_mmap) {
+        // Preallocated to its full size, the zeros past the last record end the log
+        struct stat status;
+        if (fstat(fd, &status) != 0 || ((size_t)status.st_size < file->options.segment_size && ftruncate(fd, (off_t)file->options.segment_size) != 0)) {
+            close(fd);
+            return false;
+        }
+        void* map = mmap(NULL, file->options.segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        segment->map = (uint8_t*)map;
+    }
+    segment->fd = fd;
+    segment->id = id;
+    return true;
+}
+
+static bool _segment_read(_FileStore* file, _Segment* segment, size_t offset, uint8_t* bytes, size_t length) {
+    if (offset + length > file->options.segment_size) return false;
+    if (segment->map == NULL) return _pread_all(segment->fd, bytes, length, offset);
+    memcpy(bytes, &(segment->map[offset]), length);
+    return true;
+}
+
+static bool _segment_write(_Segment* segment, size_t offset, const uint8_t* bytes, size_t length) {
+    if (length == 0) return true;
+    if (segment->map == NULL) return _pwrite_all(segment->fd, bytes, length, offset);
+    memcpy(&(segment->map[offset]), bytes, length);
+    return true;
+}
+
+static void _sync_segment(_FileStore* file, _Segment* segment) {
+    if (segment->fd < 0) return;
+    if (segment->map != NULL) msync(segment->map, file->options.segment_size, MS_SYNC);
+    else fsync(segment->fd);
+}
+
+static _Segment* _segment_for(_FileStore* file, uint32_t id) {
+    // The open segment with this id, NULL if its file is missing
+    if (file->write_segment.fd >= 0 && file->write_segment.id == id) return &(file->write_segment);
+    if (file->read_segment.fd >= 0 && file->read_segment.id == id) return &(file->read_segment);
+    if (!_open_segment(file, &(file->read_segment), id, false)) return NULL;
+    return &(file->read_segment);
+}
+
+static bool _record_at(_FileStore* file, _Segment* segment, size_t offset, size_t* length) {
+    /* Checks the record at offset, false at the end of the segment's log */
+    uint8_t header[_FILE_RECORD_HEADER_SIZE];
+    if (offset + _FILE_RECORD_HEADER_SIZE > file->options.segment_size) return false;
+    if (!_segment_read(file, segment, offset, header, _FILE_RECORD_HEADER_SIZE)) return false;
+    if (_get_u32(header) != _FILE_RECORD_MAGIC || _get_u32(&header[4]) != segment->id) return false;
+    size_t record_length = _get_u32(&header[8]);
+    if (record_length == 0 || record_length > file->options.segment_size - offset - _FILE_RECORD_HEADER_SIZE) return false;
+
+    uint32_t crc = _crc32_update(0xffffffffUL, &header[4], 8);
+    size_t position = offset + _FILE_RECORD_HEADER_SIZE;
+    if (segment->map != NULL) {
+        crc = _crc32_update(crc, &(segment->map[position]), record_length);
+    } else {
+        uint8_t chunk[256];
+        for (size_t done = 0; done < record_length;) {
+            size_t count = record_length - done < sizeof(chunk) ? record_length - done : sizeof(chunk);
+            if (!_pread_all(segment->fd, chunk, count, position + done)) return false;
+            crc = _crc32_update(crc, chunk, count);
+            done += count;
+        }
+    }
+    if ((uint32_t)(crc ^ 0xffffffffUL) != _get_u32(&header[12])) return false;
+    *length = record_length;
+    return true;
+}
+
+static size_t _scan_segment(_FileStore* file, _Segment* segment, size_t offset, size_t* count) {
+    // End of the valid records from offset, counting them
+    size_t length;
+    while (_record_at(file, segment, offset, &length)) {
+        offset += _FILE_RECORD_HEADER_SIZE + length;
+        if (count != NULL) (*count)++;
+    }
+    return offset;
+}
+
+
+// Cursor Functions
+
+static bool _write_cursor(_FileStore* file) {
+    uint8_t cursor[_FILE_CURSOR_SIZE];
+    _put_u32(cursor, _FILE_CURSOR_MAGIC);
+    _put_u32(&cursor[4], file->read_id);
+    _put_u32(&cursor[8], (uint32_t)file->read_offset);
+    _put_u32(&cursor[12], (uint32_t)(_crc32_update(0xffffffffUL, &cursor[4], 8) ^ 0xffffffffUL));
+
+    int fd = open(_file_path(file, file->path, "cursor.tmp"), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool written = _pwrite_all(fd, cursor, _FILE_CURSOR_SIZE, 0) && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(file->path, _file_path(file, file->path_2, "cursor")) != 0) return false;
+    _sync_directory(file);
+    file->drops_since_checkpoint = 0;
+    return true;
+}
+
+static bool _read_cursor(_FileStore* file, uint32_t* id, size_t* offset) {
+    uint8_t cursor[_FILE_CURSOR_SIZE];
+    int fd = open(_file_path(file, file->path, "cursor"), O_RDONLY);
+    if (fd < 0) return false;
+    bool read = _pread_all(fd, cursor, _FILE_CURSOR_SIZE, 0);
+    close(fd);
+    if (!read || _get_u32(cursor) != _FILE_CURSOR_MAGIC) return false;
+    if ((uint32_t)(_crc32_update(0xffffffffUL, &cursor[4], 8) ^ 0xffffffffUL) != _get_u32(&cursor[12])) return false;
+    *id = _get_u32(&cursor[4]);
+    *offset = _get_u32(&cursor[8]);
+    return true;
+}
+
+static void _add_spare(_FileStore* file, uint32_t id) {
+    // Keeps up to segment_count spare files, the rest are deleted
+    if (file->spares_count < file->options.segment_count) {
+        file->spares[file->spares_count++] = id;
+        return;
+    }
+    unlink(_segment_path(file, file->path, id));
+}
+
+static void _advance_read_segment(_FileStore* file) {
+    /* Moves the read position to the start of the next segment, the one it leaves becomes a spare */
+    uint32_t finished = file->read_id;
+    if (file->read_segment.id == finished) _close_segment(file, &(file->read_segment));
+    file->read_id++;
+    file->read_offset = 0;
+    file->oldest_length = 0;
+    // The spare is only reused after the cursor stops pointing at it
+    _write_cursor(file);
+    _add_spare(file, finished);
+}
+
+
+// Store Functions
+
+static bool _log_empty(_FileStore* file) {
+    return file->read_id == file->write_id && file->read_offset >= file->write_offset;
+}
+
+static size_t _file_oldest(SparkplugHistoryStore* store) {
+    _FileStore* file = (_FileStore*)store;
+    if (file->oldest_length > 0) return file->oldest_length;
+    while (!_log_empty(file)) {
+        _Segment* segment = _segment_for(file, file->read_id);
+        size_t length;
+        if (segment != NULL && _record_at(file, segment, file->read_offset, &length)) {
+            file->oldest_length = length;
+            return length;
+        }
+        // The end of a finished segment, or a segment that went missing
+        if (file->read_id == file->write_id) break;
+        _advance_read_segment(file);
+    }
+    return 0;
+}
+
+static bool _file_read(SparkplugHistoryStore* store, size_t offset, uint8_t* bytes, size_t length) {
+    _FileStore* file = (_FileStore*)store;
+    size_t record_length = _file_oldest(store);
+    if (offset + length > record_length) return false;
+    _Segment* segment = _segment_for(file, file->read_id);
+    if (segment == NULL) return false;
+    return _segment_read(file, segment, file->read_offset + _FILE_RECORD_HEADER_SIZE + offset, bytes, length);
+}
+
+static bool _file_drop(SparkplugHistoryStore* store) {
+    _FileStore* file = (_FileStore*)store;
+    size_t record_length = _file_oldest(store);
+    if (record_length == 0) return false;
+    file->read_offset += _FILE_RECORD_HEADER_SIZE + record_length;
+    file->oldest_length = 0;
+    file->drops_since_checkpoint++;
+    if (file->drops_since_checkpoint >= file->options.checkpoint_interval) _write_cursor(file);
+    return true;
+}
+
+static bool _next_write_segment(_FileStore* file) {
+    /* Starts the segment after the write segment, false if the log is full and keeps its records */
+    if ((size_t)(file->write_id - file->read_id) + 1 >= file->options.segment_count) {
+        if (file->options.overflow == spn_HISTORY_DROP_NEWEST) return false;
+        // Drop the oldest segment's unread records
+        _Segment* segment = _segment_for(file, file->read_id);
+        size_t count = 0;
+        if (segment != NULL) _scan_segment(file, segment, file->read_offset, &count);
+        file->store.dropped += count;
+        _advance_read_segment(file);
+    }
+
+    _sync_segment(file, &(file->write_segment));
+    uint32_t id = file->write_id + 1;
+    _segment_path(file, file->path_2, id);
+    if (file->spares_count > 0) {
+        uint32_t spare = file->spares[--file->spares_count];
+        if (rename(_segment_path(file, file->path, spare), file->path_2) != 0) unlink(file->path);
+    }
+    if (!_open_segment(file, &(file->write_segment), id, true)) return false;
+    _sync_directory(file);
+    file->write_id = id;
+    file->write_offset = 0;
+    return true;
+}
+
+static bool _file_append(SparkplugHistoryStore* store, const uint8_t* head, size_t head_length, const uint8_t* body, size_t body_length) {
+    _FileStore* file = (_FileStore*)store;
+    size_t length = head_length + body_length;
+    if (length == 0 || _FILE_RECORD_HEADER_SIZE + length > file->options.segment_size) return false;
+    if (file->write_offset + _FILE_RECORD_HEADER_SIZE + length > file->options.segment_size) {
+        if (!_next_write_segment(file)) return false;
+    }
+    if (file->write_segment.fd < 0) return false;
+
+    uint8_t header[_FILE_RECORD_HEADER_SIZE];
+    _put_u32(header, _FILE_RECORD_MAGIC);
+    _put_u32(&header[4], file->write_id);
+    _put_u32(&header[8], (uint32_t)length);
+    uint32_t crc = _crc32_update(0xffffffffUL, &header[4], 8);
+    crc = _crc32_update(crc, head, head_length);
+    crc = _crc32_update(crc, body, body_length);
+    _put_u32(&header[12], (uint32_t)(crc ^ 0xffffffffUL));
+
+    // A torn write fails the CRC, the record is then not part of the log
+    _Segment* segment = &(file->write_segment);
+    size_t offset = file->write_offset;
+    if (!_segment_write(segment, offset + _FILE_RECORD_HEADER_SIZE, head, head_length)) return false;
+    if (!_segment_write(segment, offset + _FILE_RECORD_HEADER_SIZE + head_length, body, body_length)) return false;
+    if (!_segment_write(segment, offset, header, _FILE_RECORD_HEADER_SIZE)) return false;
+    file->write_offset += _FILE_RECORD_HEADER_SIZE + length;
+
+    file->appends_since_sync++;
+    if (file->appends_since_sync >= file->options.sync_interval) {
+        _sync_segment(file, segment);
+        file->appends_since_sync = 0;
+    }
+    return true;
+}
+
+static void _free_file_store(_FileStore* file) {
+    _close_segment(file, &(file->write_segment));
+    _close_segment(file, &(file->read_segment));
+    free(file->spares);
+    free(file->directory);
+    free(file->path);
+    free(file->path_2);
+    free(file);
+}
+
+static void _file_close(SparkplugHistoryStore* store) {
+    _FileStore* file = (_FileStore*)store;
+    _sync_segment(file, &(file->write_segment));
+    _write_cursor(file);
+    _free_file_store(file);
+}
+
+
+// Open Functions
+
+static int _compare_ids(const void* a, const void* b) {
+    uint32_t id_a = *(const uint32_t*)a;
+    uint32_t id_b = *(const uint32_t*)b;
+    return id_a < id_b ? -1 : (id_a > id_b ? 1 : 0);
+}
+
+static bool _segment_id_from_name(const char* name, uint32_t* id) {
+    if (strlen(name) != _FILE_SEGMENT_NAME_LENGTH || strcmp(&name[8], ".seg") != 0) return false;
+    uint32_t value = 0;
+    for (size_t i = 0; i < 8; i++) {
+        char c = name[i];
+        uint32_t digit;
+        if (c >= '0' && c <= '9') digit = (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f') digit = (uint32_t)(c - 'a' + 10);
+        else return false;
+        value = (value << 4) | digit;
+    }
+    *id = value;
+    return true;
+}
+
+static bool _list_segments(_FileStore* file, uint32_t** ids, size_t* count) {
+    DIR* directory = opendir(file->directory);
+    if (directory == NULL) return false;
+    size_t allocated = 0;
+    *ids = NULL;
+    *count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL) {
+        uint32_t id;
+        if (!_segment_id_from_name(entry->d_name, &id)) continue;
+        if (*count == allocated) {
+            allocated = allocated == 0 ? 16 : allocated * 2;
+            uint32_t* grown = (uint32_t*)realloc(*ids, allocated * sizeof(uint32_t));
+            if (grown == NULL) {
+                closedir(directory);
+                return false;
+            }
+            *ids = grown;
+        }
+        (*ids)[(*count)++] = id;
+    }
+    closedir(directory);
+    if (*count > 1) qsort(*ids, *count, sizeof(uint32_t), _compare_ids);
+    return true;
+}
+
+static bool _recover(_FileStore* file) {
+    /* Finds the read and write positions left by the last run */
+    uint32_t* ids = NULL;
+    size_t count;
+    if (!_list_segments(file, &ids, &count)) {
+        free(ids);
+        return false;
+    }
+
+    uint32_t cursor_id;
+    size_t cursor_offset;
+    bool cursor_found = _read_cursor(file, &cursor_id, &cursor_offset);
+    file->read_id = cursor_found ? cursor_id : (count > 0 ? ids[0] : 0);
+    file->read_offset = cursor_found ? cursor_offset : 0;
+    file->write_id = file->read_id;
+    for (size_t i = 0; i < count; i++) {
+        if (ids[i] < file->read_id) _add_spare(file, ids[i]);
+        else file->write_id = ids[i];
+    }
+    free(ids);
+
+    if (!_open_segment(file, &(file->write_segment), file->write_id, true)) return false;
+    file->write_offset = _scan_segment(file, &(file->write_segment), 0, NULL);
+    if (file->read_id == file->write_id && file->read_offset > file->write_offset) file->read_offset = file->write_offset;
+    return _write_cursor(file);
+}
+
+SparkplugHistoryStore* openFileHistoryStore(const SparkplugFileHistoryOptions* options) {
+    if (options == NULL || options->directory == NULL) return NULL;
+    if (options->segment_count < 2 || options->segment_size <= _FILE_RECORD_HEADER_SIZE || options->segment_size > UINT32_MAX) return NULL;
+    if (mkdir(options->directory, 0755) != 0 && errno != EEXIST) return NULL;
+
+    _FileStore* file = (_FileStore*)calloc(1, sizeof(_FileStore));
+    if (file == NULL) return NULL;
+    file->options = *options;
+    if (file->options.sync_interval == 0) file->options.sync_interval = 1;
+    if (file->options.checkpoint_interval == 0) file->options.checkpoint_interval = 1;
+    file->write_segment.fd = -1;
+    file->read_segment.fd = -1;
+    file->store.append = _file_append;
+    file->store.oldest = _file_oldest;
+    file->store.read = _file_read;
+    file->store.drop = _file_drop;
+    file->store.close = _file_close;
+
+    size_t directory_length = strlen(options->directory);
+    file->directory = (char*)malloc(directory_length + 1);
+    file->path_size = directory_length + _FILE_SEGMENT_NAME_LENGTH + 2;
+    file->path = (char*)malloc(file->path_size);
+    file->path_2 = (char*)malloc(file->path_size);
+    file->spares = (uint32_t*)malloc(options->segment_count * sizeof(uint32_t));
+    if (file->directory == NULL || file->path == NULL || file->path_2 == NULL || file->spares == NULL) {
+        _free_file_store(file);
+        return NULL;
+    }
+    memcpy(file->directory, options->directory, directory_length + 1);
+    file->options.directory = file->directory;
+
+    if (!_recover(file)) {
+        _free_file_store(file);
+        return NULL;
+    }
+    return &(file->store);
+}
+
+#else
+
+SparkplugHistoryStore* openFileHistoryStore(const SparkplugFileHistoryOptions* options) {
+    // No file system API on this target
+    (void)options;
+    return NULL;
+}
+
+#endif
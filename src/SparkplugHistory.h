@@ -0,0 +1,83 @@
+/*
+Copyright 2024 Michael Keras.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SPARKPLUG_HISTORY_H
+#define SPARKPLUG_HISTORY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// What a full store does with a new record
+typedef enum {
+    spn_HISTORY_DROP_OLDEST = 0,
+    spn_HISTORY_DROP_NEWEST = 1
+} SparkplugHistoryOverflow;
+
+/*
+Store and forward storage, a FIFO of records. A node appends the historical payloads made while
+MQTT is down and reads them back, oldest first, once reconnected. Only the oldest record is read,
+in parts, so a store never has to hold more than one record in memory.
+*/
+typedef struct SparkplugHistoryStore SparkplugHistoryStore;
+struct SparkplugHistoryStore {
+    // Append head then body as one record, false if the store can't take it
+    bool (*append)(SparkplugHistoryStore* store, const uint8_t* head, size_t head_length, const uint8_t* body, size_t body_length);
+    // Length of the oldest record, 0 when the store is empty
+    size_t (*oldest)(SparkplugHistoryStore* store);
+    // Bytes [offset, offset + length) of the oldest record
+    bool (*read)(SparkplugHistoryStore* store, size_t offset, uint8_t* bytes, size_t length);
+    // Remove the oldest record
+    bool (*drop)(SparkplugHistoryStore* store);
+    void (*close)(SparkplugHistoryStore* store);
+    size_t dropped;  // Records lost to overflow, counted by the store and the node
+};
+
+// Records kept in a RAM ring of size bytes, lost on restart
+SparkplugHistoryStore* createMemoryHistoryStore(size_t size, SparkplugHistoryOverflow overflow);
+
+typedef struct {
+    const char* directory;  // Created if missing, holds the segment files and the read cursor
+    size_t segment_size;  // Bytes per segment file, the largest record must fit in one
+    size_t segment_count;  // At least 2, the store holds up to segment_size * segment_count bytes
+    SparkplugHistoryOverflow overflow;  // Drop oldest discards the whole oldest segment
+    bool use_mmap;  // Segments are preallocated and mapped instead of written with pwrite
+    uint16_t sync_interval;  // Records appended between syncs to storage, 0 or 1 syncs every record
+    uint16_t checkpoint_interval;  // Records dropped between read cursor checkpoints, 0 or 1 checkpoints every record
+} SparkplugFileHistoryOptions;
+
+// 1 MB segments, 64 segments, drop oldest, pwrite, sync every record, checkpoint every 16 records
+SparkplugFileHistoryOptions defaultFileHistoryOptions(const char* directory);
+
+/*
+Records kept in an append-only log of segment files, which survives a restart or power loss.
+Available on POSIX systems (Linux, macOS), NULL elsewhere or if the directory can't be used
+*/
+SparkplugHistoryStore* openFileHistoryStore(const SparkplugFileHistoryOptions* options);
+
+// Syncs and frees a store of either kind
+void closeHistoryStore(SparkplugHistoryStore* store);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif // SPARKPLUG_HISTORY_H
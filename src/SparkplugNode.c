@@ -20,6 +20,9 @@ static const bool _USE_SPARKPLUG_3 = false;
 static const char* _TOPIC_NAMESPACE = "spBv1.0";
 static const size_t _TOPIC_NAMESPACE_LEN = 7;
 
+static void _flush_history_batch(SparkplugNodeConfig* node, SparkplugHistoryBatch* batch, const char* device_id);
+static void _flush_history_batches(SparkplugNodeConfig* node, bool expired_only);
+
 
 const char* _make_topic_char(const char* group_id, const char* node_id, const char* topic_type) {
     size_t group_id_len = strlen(group_id);
@@ -46,14 +49,62 @@ const char* _make_topic_char(const char* group_id, const char* node_id, const ch
     return (const char*)newChar;
 }
 
+static const char* _make_device_topic_char(const char* group_id, const char* node_id, const char* device_id, const char* topic_type) {
+    // Device topics are node topics with "/device_id" appended
+    size_t node_id_len = strlen(node_id);
+    size_t device_id_len = strlen(device_id);
+    char* ids = (char*)malloc(node_id_len + device_id_len + 2);
+    if (ids == NULL) return NULL;
+    memcpy(ids, node_id, node_id_len);
+    ids[node_id_len] = '/';
+    memcpy(&ids[node_id_len + 1], device_id, device_id_len);
+    ids[node_id_len + device_id_len + 1] = '\0';
+    const char* topic = _make_topic_char(group_id, ids, topic_type);
+    free(ids);
+    return topic;
+}
+
+static void _use_node_context(SparkplugNodeConfig* node) {
+    // Payload functions work on the current context, select the node's before calling them
+    setSparkplugContext(node->context);
+}
+
 static void* _get_tag_value_address(const char* tag_name) {
-    FunctionalBasicTag* tag = getTagByName(tag_name);
+    FunctionalBasicTag* tag = findSparkplugTagByName(tag_name);
     if (tag == NULL) return NULL;
     return tag->value_address;
 }
 
+SparkplugNodeOptions spnDefaultNodeOptions(size_t payload_buffer_size) {
+    SparkplugNodeOptions options;
+    options.payload_buffer_size = payload_buffer_size;
+    options.payload_buffer_count = 1;
+    options.ncmd_arena_size = SPARKPLUG_DECODE_ARENA_SIZE;
+    options.ncmd_stream_buffer_size = 0;
+    options.ncmd_queue_length = 0;
+    options.ncmd_queue_slot_size = 0;
+    options.own_tags = false;
+    options.history_buffer_size = 0;
+    options.history_overflow = spn_HISTORY_DROP_OLDEST;
+    options.replay_bytes_per_second = 0;
+    options.replay_messages_per_second = 0;
+    options.replay_merge = false;
+    options.history_batch_ms = 0;
+    options.history_batch_size = 0;
+    return options;
+}
+
 SparkplugNodeConfig* createSparkplugNode(const char* group_id, const char* node_id, size_t payload_buffer_size, TimestampFunction timestamp_function) {
-    if (node_id == NULL || group_id == NULL || payload_buffer_size == 0 || timestamp_function == NULL) return NULL;
+    SparkplugNodeOptions options = spnDefaultNodeOptions(payload_buffer_size);
+    return createSparkplugNodeWithOptions(group_id, node_id, &options, timestamp_function);
+}
+
+SparkplugNodeConfig* createSparkplugNodeWithOptions(const char* group_id, const char* node_id, const SparkplugNodeOptions* options, TimestampFunction timestamp_function) {
+    if (node_id == NULL || group_id == NULL || options == NULL || timestamp_function == NULL) return NULL;
+    size_t payload_buffer_size = options->payload_buffer_size;
+    uint8_t payload_buffer_count = options->payload_buffer_count;
+    if (payload_buffer_size == 0 || payload_buffer_count == 0) return NULL;
+    if (payload_buffer_size > SIZE_MAX / payload_buffer_count) return NULL;
     SparkplugNodeConfig* newNode = (SparkplugNodeConfig*)malloc(sizeof(SparkplugNodeConfig));
     if (newNode == NULL) return NULL;
 
@@ -61,6 +112,7 @@ SparkplugNodeConfig* createSparkplugNode(const char* group_id, const char* node_
     setBasicTagTimestampFunction(timestamp_function);
 
     newNode->tags_group = NULL; // NOT CURRENTLY USED
+    newNode->context = NULL;
     newNode->group_id = group_id;
     newNode->node_id = node_id;
     newNode->timestamp_function = timestamp_function;
@@ -70,9 +122,79 @@ SparkplugNodeConfig* createSparkplugNode(const char* group_id, const char* node_
     newNode->vars.sequence = 0;
     newNode->vars.initial_birth_made = false;
     newNode->vars.mqtt_connected = false;
+    newNode->vars.split_payloads = false;
+    newNode->vars.staged_ncmd = false;
+    newNode->vars.ndata_parts_pending = false;
+    newNode->vars.nbirth_fragments_pending = false;
+    newNode->vars.pending_timestamp = 0;
+    newNode->vars.pending_offset = 0;
+    newNode->vars.pending_total_length = 0;
+    for (size_t i = 0; i < SPARKPLUG_SCAN_CLASSES; i++) {
+        newNode->scan_classes.rates[i] = 0;
+        newNode->scan_classes.last_scan[i] = 0;
+    }
+    newNode->scan_classes.due = 0;
 
     newNode->mqtt_message.topic = NULL;
     newNode->mqtt_message.payload = NULL;
+    newNode->mqtt_message.offset = 0;
+    newNode->mqtt_message.total_length = 0;
+
+    // Everything freed by deleteSparkplugNode must be NULL before the first failure path
+    newNode->topics.NCMD = NULL;
+    newNode->topics.NBIRTH = NULL;
+    newNode->topics.NDEATH = NULL;
+    newNode->topics.NDATA = NULL;
+    newNode->payload_buffers.buffers = NULL;
+    newNode->payload_buffers.in_use = NULL;
+    newNode->payload_buffers.count = 0;
+    newNode->payload_buffers.next = 0;
+    newNode->ncmd_arena = NULL;
+    newNode->ncmd_arena_size = 0;
+    newNode->ncmd_stream.buffer = NULL;
+    newNode->ncmd_queue.data = NULL;
+    newNode->ncmd_queue.lengths = NULL;
+    newNode->ncmd_queue.last = NULL;
+    newNode->devices.list = NULL;
+    newNode->devices.count = 0;
+    newNode->devices.allocated = 0;
+    newNode->devices.next = 0;
+    newNode->devices.nbirth_made = false;
+    newNode->history = NULL;
+    // Only set once initializeSparkplugTags succeeded, deleteSparkplugNode leaves the tags alone until then
+    newNode->node_tags.bd_seq = NULL;
+    newNode->node_tags.rebirth = NULL;
+    newNode->node_tags.scan_rate = NULL;
+    newNode->replay.bytes_per_second = options->replay_bytes_per_second;
+    newNode->replay.messages_per_second = options->replay_messages_per_second;
+    newNode->replay.merge = options->replay_merge;
+    newNode->replay.byte_credit = 0;
+    newNode->replay.message_credit = 0;
+    newNode->replay.last_refill = 0;
+    newNode->replay.live_sent = false;
+    newNode->history_batch.data = NULL;
+    newNode->history_batch.length = 0;
+    newNode->history_batch.samples = 0;
+    newNode->history_batch.started = 0;
+    newNode->history_batch_ms = options->history_batch_ms;
+    // A batch is sent as one payload, with a seq of up to 3 bytes
+    newNode->history_batch_size = payload_buffer_size > 3 ? payload_buffer_size - 3 : 0;
+    if (options->history_batch_size > 0 && options->history_batch_size < newNode->history_batch_size) newNode->history_batch_size = options->history_batch_size;
+
+    // A node with its own tags has its own context, everything below is set up in it
+    if (options->own_tags) {
+        newNode->context = createSparkplugContext(true);
+        if (newNode->context == NULL) {
+            deleteSparkplugNode(newNode);
+            return NULL;
+        }
+    }
+    _use_node_context(newNode);
+    // The default context already belongs to another node, initialize must be done by this function
+    if (sparkplugInitialized()) {
+        deleteSparkplugNode(newNode);
+        return NULL;
+    }
 
     newNode->topics.NCMD = _make_topic_char(group_id, node_id, "NCMD");
     if (newNode->topics.NCMD == NULL) {
@@ -95,22 +217,65 @@ SparkplugNodeConfig* createSparkplugNode(const char* group_id, const char* node_
         return NULL;
     }
     
-    // Allocate the BufferValue
-    newNode->payload_buffer.buffer = (uint8_t*)malloc(payload_buffer_size);
-    if (newNode->payload_buffer.buffer == NULL) {
+    // Allocate the BufferValues, all buffers share one allocation
+    newNode->payload_buffers.buffers = (BufferValue*)malloc(sizeof(BufferValue) * payload_buffer_count);
+    newNode->payload_buffers.in_use = (bool*)malloc(sizeof(bool) * payload_buffer_count);
+    if (newNode->payload_buffers.buffers == NULL || newNode->payload_buffers.in_use == NULL) {
         deleteSparkplugNode(newNode);
         return NULL;
     }
-    newNode->payload_buffer.allocated_length = payload_buffer_size;
-    newNode->payload_buffer.written_length = 0;
-
-    // initialize sparkplug tags
-    if (sparkplugInitialized()) {
-        // initialize must be done by this function
+    uint8_t* buffer_bytes = (uint8_t*)malloc(payload_buffer_size * payload_buffer_count);
+    if (buffer_bytes == NULL) {
         deleteSparkplugNode(newNode);
         return NULL;
     }
-    if (!initializeSparkplugTags(&(newNode->payload_buffer), NULL)) {
+    for (uint8_t i = 0; i < payload_buffer_count; i++) {
+        newNode->payload_buffers.buffers[i].buffer = &buffer_bytes[payload_buffer_size * i];
+        newNode->payload_buffers.buffers[i].allocated_length = payload_buffer_size;
+        newNode->payload_buffers.buffers[i].written_length = 0;
+        newNode->payload_buffers.in_use[i] = false;
+    }
+    newNode->payload_buffers.count = payload_buffer_count;
+
+    // NCMD scratch memory, processIncomingNCMDPayload decodes without heap calls
+    if (options->ncmd_arena_size > 0) {
+        newNode->ncmd_arena = (uint8_t*)malloc(options->ncmd_arena_size);
+        if (newNode->ncmd_arena == NULL) {
+            deleteSparkplugNode(newNode);
+            return NULL;
+        }
+        newNode->ncmd_arena_size = options->ncmd_arena_size;
+    }
+
+    // Buffer for one metric of an NCMD fed with spnNCMDFeed
+    if (options->ncmd_stream_buffer_size > 0) {
+        uint8_t* stream_buffer = (uint8_t*)malloc(options->ncmd_stream_buffer_size);
+        if (stream_buffer == NULL) {
+            deleteSparkplugNode(newNode);
+            return NULL;
+        }
+        initNCMDStream(&(newNode->ncmd_stream), stream_buffer, options->ncmd_stream_buffer_size, NULL, false);
+    }
+
+    // Queue between the NCMD receiving task and tickSparkplugNode
+    if (options->ncmd_queue_length > 0) {
+        if (!initNCMDQueue(&(newNode->ncmd_queue), options->ncmd_queue_length, options->ncmd_queue_slot_size)) {
+            deleteSparkplugNode(newNode);
+            return NULL;
+        }
+    }
+
+    // Historical payloads kept while MQTT is down
+    if (options->history_buffer_size > 0) {
+        newNode->history = createMemoryHistoryStore(options->history_buffer_size, options->history_overflow);
+        if (newNode->history == NULL) {
+            deleteSparkplugNode(newNode);
+            return NULL;
+        }
+    }
+
+    // initialize sparkplug tags
+    if (!initializeSparkplugTags(&(newNode->payload_buffers.buffers[0]), NULL, NULL)) {
         deleteSparkplugNode(newNode);
         return NULL;
     }
@@ -128,8 +293,20 @@ SparkplugNodeConfig* createSparkplugNode(const char* group_id, const char* node_
 }
 
 
+static void _free_device(SparkplugDeviceConfig* device) {
+    if (device->topics.DCMD != NULL) free((char*)device->topics.DCMD);
+    if (device->topics.DBIRTH != NULL) free((char*)device->topics.DBIRTH);
+    if (device->topics.DDEATH != NULL) free((char*)device->topics.DDEATH);
+    if (device->topics.DDATA != NULL) free((char*)device->topics.DDATA);
+    if (device->context != NULL) deleteSparkplugContext(device->context);
+    if (device->history_batch.data != NULL) free(device->history_batch.data);
+    free(device);
+}
+
+
 bool deleteSparkplugNode(SparkplugNodeConfig* sparkplug_node) {
     if (sparkplug_node == NULL) return false;
+    _use_node_context(sparkplug_node);
 
     // free the topics
     if (sparkplug_node->topics.NCMD != NULL) free(sparkplug_node->topics.NCMD);
@@ -141,12 +318,52 @@ bool deleteSparkplugNode(SparkplugNodeConfig* sparkplug_node) {
     sparkplug_node->topics.NDEATH = NULL;
     sparkplug_node->topics.NDATA = NULL;
 
-    // free the buffer
-    if(sparkplug_node->payload_buffer.buffer != NULL) free(sparkplug_node->payload_buffer.buffer);
-    sparkplug_node->payload_buffer.buffer = NULL;
+    // free the buffers, the bytes of every buffer start at buffers[0]
+    if (sparkplug_node->payload_buffers.buffers != NULL) {
+        if (sparkplug_node->payload_buffers.count > 0) free(sparkplug_node->payload_buffers.buffers[0].buffer);
+        free(sparkplug_node->payload_buffers.buffers);
+    }
+    if (sparkplug_node->payload_buffers.in_use != NULL) free(sparkplug_node->payload_buffers.in_use);
+    sparkplug_node->payload_buffers.buffers = NULL;
+    sparkplug_node->payload_buffers.in_use = NULL;
+    sparkplug_node->payload_buffers.count = 0;
+
+    // free the NCMD arena
+    if (sparkplug_node->ncmd_arena != NULL) {
+        setDecodeArena(NULL, 0);
+        free(sparkplug_node->ncmd_arena);
+    }
+    sparkplug_node->ncmd_arena = NULL;
+    sparkplug_node->ncmd_arena_size = 0;
 
-    // delete the sparkplug tags
-    deleteSparkplugTags();
+    // free the NCMD stream buffer
+    if (sparkplug_node->ncmd_stream.buffer != NULL) {
+        resetNCMDStream(&(sparkplug_node->ncmd_stream));
+        free(sparkplug_node->ncmd_stream.buffer);
+    }
+    sparkplug_node->ncmd_stream.buffer = NULL;
+
+    // free the NCMD queue
+    freeNCMDQueue(&(sparkplug_node->ncmd_queue));
+
+    // close the store and forward store, with the scans still being accumulated
+    _flush_history_batches(sparkplug_node, false);
+    closeHistoryStore(sparkplug_node->history);
+    sparkplug_node->history = NULL;
+    if (sparkplug_node->history_batch.data != NULL) free(sparkplug_node->history_batch.data);
+    sparkplug_node->history_batch.data = NULL;
+
+    // free the devices
+    for (size_t i = 0; i < sparkplug_node->devices.count; i++) _free_device(sparkplug_node->devices.list[i]);
+    if (sparkplug_node->devices.list != NULL) free(sparkplug_node->devices.list);
+    sparkplug_node->devices.list = NULL;
+    sparkplug_node->devices.count = 0;
+    _use_node_context(sparkplug_node);
+
+    // delete the sparkplug tags, with the node's own context, unless they were never this node's
+    if (sparkplug_node->node_tags.bd_seq != NULL) deleteSparkplugTags();
+    if (sparkplug_node->context != NULL) deleteSparkplugContext(sparkplug_node->context);
+    sparkplug_node->context = NULL;
 
     // finally, free the node itself
     free(sparkplug_node);
@@ -154,6 +371,196 @@ bool deleteSparkplugNode(SparkplugNodeConfig* sparkplug_node) {
 }
 
 
+bool spnAddTag(SparkplugNodeConfig* node, FunctionalBasicTag* tag) {
+    if (node == NULL) return false;
+    _use_node_context(node);
+    return addSparkplugTag(tag);
+}
+
+
+bool spnRemoveTag(SparkplugNodeConfig* node, FunctionalBasicTag* tag) {
+    if (node == NULL) return false;
+    _use_node_context(node);
+    return removeSparkplugTag(tag);
+}
+
+
+bool spnSetTagScanClass(SparkplugNodeConfig* node, FunctionalBasicTag* tag, uint8_t scan_class) {
+    if (node == NULL) return false;
+    _use_node_context(node);
+    return setTagScanClass(tag, scan_class);
+}
+
+
+bool spnSetScanClassRate(SparkplugNodeConfig* node, uint8_t scan_class, uint32_t rate_ms) {
+    if (node == NULL || scan_class == 0 || scan_class >= SPARKPLUG_SCAN_CLASSES) return false;
+    node->scan_classes.rates[scan_class] = rate_ms;
+    // Read on the next tick, then at the new rate
+    node->scan_classes.last_scan[scan_class] = 0;
+    return true;
+}
+
+
+bool spnSetHistoryStore(SparkplugNodeConfig* node, SparkplugHistoryStore* store) {
+    if (node == NULL) return false;
+    if (node->history == store) return true;
+    _flush_history_batches(node, false);
+    closeHistoryStore(node->history);
+    node->history = store;
+    return true;
+}
+
+
+
+/*
+Device Functions
+
+Each device has its own context, so its tags, birth cache and changed tag list are separate from
+the node's and from other devices'. The node's scan reads every online device, and the device
+payloads go out one per tick between scans: DDEATHs and DBIRTHs first, then the DDATA of each
+device that changed. Device payloads wait for the NBIRTH of the session, and every NBIRTH is
+followed by the DBIRTH of every online device.
+*/
+
+SparkplugDeviceConfig* spnGetDevice(SparkplugNodeConfig* node, const char* device_id) {
+    if (node == NULL || device_id == NULL) return NULL;
+    for (size_t i = 0; i < node->devices.count; i++) {
+        if (strcmp(node->devices.list[i]->device_id, device_id) == 0) return node->devices.list[i];
+    }
+    return NULL;
+}
+
+
+SparkplugDeviceConfig* spnAddDevice(SparkplugNodeConfig* node, const char* device_id) {
+    // The node's own tag set keeps the device tags out of its NBIRTH
+    if (node == NULL || device_id == NULL || node->context == NULL) return NULL;
+    if (spnGetDevice(node, device_id) != NULL) return NULL;
+
+    struct Devices* devices = &(node->devices);
+    if (devices->count == devices->allocated) {
+        size_t allocated = devices->allocated > 0 ? devices->allocated * 2 : 4;
+        SparkplugDeviceConfig** list = (SparkplugDeviceConfig**)realloc(devices->list, allocated * sizeof(SparkplugDeviceConfig*));
+        if (list == NULL) return NULL;
+        devices->list = list;
+        devices->allocated = allocated;
+    }
+
+    SparkplugDeviceConfig* device = (SparkplugDeviceConfig*)malloc(sizeof(SparkplugDeviceConfig));
+    if (device == NULL) return NULL;
+    device->device_id = device_id;
+    device->online = true;
+    device->birth_pending = devices->nbirth_made;
+    device->death_pending = false;
+    device->values_changed = false;
+    device->history_batch.data = NULL;
+    device->history_batch.length = 0;
+    device->history_batch.samples = 0;
+    device->history_batch.started = 0;
+    device->topics.DCMD = _make_device_topic_char(node->group_id, node->node_id, device_id, "DCMD");
+    device->topics.DBIRTH = _make_device_topic_char(node->group_id, node->node_id, device_id, "DBIRTH");
+    device->topics.DDEATH = _make_device_topic_char(node->group_id, node->node_id, device_id, "DDEATH");
+    device->topics.DDATA = _make_device_topic_char(node->group_id, node->node_id, device_id, "DDATA");
+    device->context = createSparkplugContext(true);
+    bool created = device->topics.DCMD != NULL && device->topics.DBIRTH != NULL && device->topics.DDEATH != NULL
+        && device->topics.DDATA != NULL && device->context != NULL;
+    if (created) {
+        setSparkplugContext(device->context);
+        created = initializeSparkplugDevice(&(node->payload_buffers.buffers[0]), NULL, NULL);
+        _use_node_context(node);
+    }
+    if (!created) {
+        _free_device(device);
+        return NULL;
+    }
+
+    devices->list[devices->count] = device;
+    devices->count++;
+    return device;
+}
+
+
+bool spnDeleteDevice(SparkplugNodeConfig* node, SparkplugDeviceConfig* device) {
+    if (node == NULL || device == NULL) return false;
+    struct Devices* devices = &(node->devices);
+    for (size_t i = 0; i < devices->count; i++) {
+        if (devices->list[i] != device) continue;
+        memmove(&(devices->list[i]), &(devices->list[i + 1]), (devices->count - i - 1) * sizeof(SparkplugDeviceConfig*));
+        devices->count--;
+        if (devices->next >= devices->count) devices->next = 0;
+        // Replayed if a device with the same id is added again before reconnecting
+        _flush_history_batch(node, &(device->history_batch), device->device_id);
+        _free_device(device);
+        _use_node_context(node);
+        return true;
+    }
+    return false;
+}
+
+
+bool spnAddDeviceTag(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, FunctionalBasicTag* tag) {
+    if (node == NULL || device == NULL) return false;
+    setSparkplugContext(device->context);
+    bool added = addSparkplugTag(tag);
+    _use_node_context(node);
+    if (added) spnRebirthDevice(node, device);
+    return added;
+}
+
+
+bool spnRemoveDeviceTag(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, FunctionalBasicTag* tag) {
+    if (node == NULL || device == NULL) return false;
+    setSparkplugContext(device->context);
+    bool removed = removeSparkplugTag(tag);
+    _use_node_context(node);
+    if (removed) spnRebirthDevice(node, device);
+    return removed;
+}
+
+
+bool spnSetDeviceTagScanClass(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, FunctionalBasicTag* tag, uint8_t scan_class) {
+    if (node == NULL || device == NULL) return false;
+    setSparkplugContext(device->context);
+    bool set = setTagScanClass(tag, scan_class);
+    _use_node_context(node);
+    return set;
+}
+
+
+bool spnRebirthDevice(SparkplugNodeConfig* node, SparkplugDeviceConfig* device) {
+    if (node == NULL || device == NULL) return false;
+    // Before the NBIRTH there is nothing to redo, the NBIRTH is followed by every DBIRTH
+    if (device->online && node->devices.nbirth_made) device->birth_pending = true;
+    return true;
+}
+
+
+bool spnSetDeviceOnline(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, bool online) {
+    if (node == NULL || device == NULL) return false;
+    if (device->online == online) return true;
+    device->online = online;
+    if (online) {
+        device->death_pending = false;
+        device->birth_pending = node->devices.nbirth_made;
+    } else {
+        // A device whose DBIRTH wasn't made yet was never reported online
+        device->death_pending = node->devices.nbirth_made && !(device->birth_pending);
+        device->birth_pending = false;
+        device->values_changed = false;
+    }
+    return true;
+}
+
+
+static void _rebirth_devices(SparkplugNodeConfig* node) {
+    node->devices.nbirth_made = true;
+    for (size_t i = 0; i < node->devices.count; i++) {
+        SparkplugDeviceConfig* device = node->devices.list[i];
+        device->death_pending = false;
+        device->birth_pending = device->online;
+    }
+}
+
+
 
 /*
 Node Functions
@@ -168,21 +575,56 @@ static void _increment_sequence(SparkplugNodeConfig* node) {
 }
 
 
+/*
+Scan classes
+
+Each tag belongs to one of SPARKPLUG_SCAN_CLASSES scan classes, class 0 unless moved with
+spnSetTagScanClass. Class 0 and the classes without a rate of their own are read at the Scan Rate
+tag's rate, the others at the rate given to spnSetScanClassRate. scanDue works out which classes
+are due and scanTags reads only their tags, so one NDATA carries the changes of every class due
+in that tick. Births and forced scans read every class.
+*/
+
 bool scanDue(SparkplugNodeConfig* node) {
     if (node == NULL) return false;
     if (node->vars.force_scan) {
         node->vars.force_scan = false;
+        node->scan_classes.due = SPARKPLUG_ALL_SCAN_CLASSES;
         return true;
     }
-    if (!(node->vars.last_scan)) return true;
-    uint64_t difference = (node->timestamp_function)() - node->vars.last_scan;
-    return difference >= *(node->vars.scan_rate_tag_value);
+    uint64_t now = (node->timestamp_function)();
+    uint32_t due = 0;
+    for (uint8_t i = 0; i < SPARKPLUG_SCAN_CLASSES; i++) {
+        uint32_t rate = node->scan_classes.rates[i];
+        // Class 0 always follows the Scan Rate tag
+        bool own_rate = i > 0 && rate > 0;
+        uint64_t last_scan = own_rate ? node->scan_classes.last_scan[i] : node->vars.last_scan;
+        if (!last_scan || now - last_scan >= (own_rate ? rate : *(node->vars.scan_rate_tag_value))) due |= 1UL << i;
+    }
+    node->scan_classes.due = due;
+    return due != 0;
 }
 
 bool scanTags(SparkplugNodeConfig* node) {
     if (node == NULL) return false;
-    node->vars.values_changed = readAllBasicTags();
-    node->vars.last_scan = node->timestamp_function();
+    // Called without scanDue every class is read
+    uint32_t due = node->scan_classes.due != 0 ? node->scan_classes.due : SPARKPLUG_ALL_SCAN_CLASSES;
+    node->scan_classes.due = 0;
+    _use_node_context(node);
+    node->vars.values_changed = readSparkplugTagClasses(due, node->timestamp_function());
+    // A device keeps its change flag until its DDATA is made
+    for (size_t i = 0; i < node->devices.count; i++) {
+        SparkplugDeviceConfig* device = node->devices.list[i];
+        if (!(device->online)) continue;
+        setSparkplugContext(device->context);
+        if (readSparkplugTagClasses(due, node->timestamp_function())) device->values_changed = true;
+    }
+    _use_node_context(node);
+    uint64_t now = node->timestamp_function();
+    if (due & 1) node->vars.last_scan = now;
+    for (uint8_t i = 1; i < SPARKPLUG_SCAN_CLASSES; i++) {
+        if (due & (1UL << i)) node->scan_classes.last_scan[i] = now;
+    }
     return true;
 }
 
@@ -201,6 +643,132 @@ static bool _make_ndata_payload(SparkplugNodeConfig* node) {
     return makeHistoricalNDATA(node->timestamp_function(), node->vars.sequence);
 }
 
+static BufferValue* _select_payload_buffer(SparkplugNodeConfig* node) {
+    /*
+    Pick the buffer the next payload is encoded into and point the encoder at it.
+    A single buffer is reused by every payload, with a ring the buffer must have been released, NULL if all are busy
+    */
+    struct PayloadBuffers* ring = &(node->payload_buffers);
+    BufferValue* selected = NULL;
+    if (ring->count < 2) {
+        selected = &(ring->buffers[0]);
+    } else {
+        for (uint8_t i = 0; i < ring->count; i++) {
+            uint8_t idx = (uint8_t)((ring->next + i) % ring->count);
+            // Pairs with the release store in spnReleasePayload, the MQTT client is done reading the bytes
+            if (!__atomic_load_n(&(ring->in_use[idx]), __ATOMIC_ACQUIRE)) {
+                selected = &(ring->buffers[idx]);
+                break;
+            }
+        }
+    }
+    if (selected != NULL) setEncodeBuffer(selected);
+    return selected;
+}
+
+static void _set_mqtt_message(SparkplugNodeConfig* node, BufferValue* payload, const char* topic, size_t offset, size_t total_length) {
+    struct PayloadBuffers* ring = &(node->payload_buffers);
+    if (ring->count > 1) {
+        // Hand ownership of the buffer to the application until it is released
+        uint8_t idx = (uint8_t)(payload - ring->buffers);
+        __atomic_store_n(&(ring->in_use[idx]), true, __ATOMIC_RELAXED);
+        ring->next = (uint8_t)((idx + 1) % ring->count);
+    }
+    node->mqtt_message.payload = payload;
+    node->mqtt_message.topic = topic;
+    node->mqtt_message.offset = offset;
+    node->mqtt_message.total_length = total_length;
+}
+
+static void _clear_mqtt_message(SparkplugNodeConfig* node) {
+    node->mqtt_message.payload = NULL;
+    node->mqtt_message.topic = NULL;
+    node->mqtt_message.offset = 0;
+    node->mqtt_message.total_length = 0;
+}
+
+static void _clear_pending_payloads(SparkplugNodeConfig* node) {
+    node->vars.ndata_parts_pending = false;
+    node->vars.nbirth_fragments_pending = false;
+    node->vars.pending_offset = 0;
+    node->vars.pending_total_length = 0;
+}
+
+static SparkplugNodeState _next_nbirth_fragment(SparkplugNodeConfig* node) {
+    /*
+    Split mode NBIRTH, makes the next fragment of a birth that may not fit in the payload buffer.
+    A birth that fits is a normal NBIRTH payload.
+    */
+    BufferValue* buffer = _select_payload_buffer(node);
+    if (buffer == NULL) return spn_PAYLOAD_BUFFERS_BUSY;
+
+    bool first = !(node->vars.nbirth_fragments_pending);
+    if (first) {
+        if (!_USE_SPARKPLUG_3) {
+            node->vars.sequence = 0;
+        }
+        node->vars.pending_timestamp = node->timestamp_function();
+        node->vars.pending_offset = 0;
+    }
+
+    size_t offset = node->vars.pending_offset;
+    bool made;
+    if (node->vars.mqtt_connected) {
+        made = makeNBIRTHFragment(node->vars.pending_timestamp, node->vars.sequence, offset, &(node->vars.pending_total_length));
+    } else {
+        made = makeHistoricalNBIRTHFragment(node->vars.pending_timestamp, node->vars.sequence, offset, &(node->vars.pending_total_length));
+    }
+    if (!made) {
+        _clear_pending_payloads(node);
+        _clear_mqtt_message(node);
+        return spn_MAKE_NBIRTH_FAILED;
+    }
+
+    size_t total_length = node->vars.pending_total_length;
+    _set_mqtt_message(node, buffer, node->topics.NBIRTH, offset, total_length);
+    node->vars.pending_offset = offset + buffer->written_length;
+    node->vars.nbirth_fragments_pending = node->vars.pending_offset < total_length;
+
+    if (first && !(node->vars.nbirth_fragments_pending)) {
+        // The whole birth fit in the buffer
+        if (node->vars.mqtt_connected) return spn_NBIRTH_PL_READY;
+        return spn_HISTORICAL_NBIRTH_PL_READY;
+    }
+    if (node->vars.mqtt_connected) return spn_NBIRTH_FRAGMENT_READY;
+    return spn_HISTORICAL_NBIRTH_FRAGMENT_READY;
+}
+
+static SparkplugNodeState _next_ndata_part(SparkplugNodeConfig* node) {
+    /*
+    Split mode NDATA, makes the next payload of changed metrics. Each part is a complete NDATA with its own seq.
+    */
+    BufferValue* buffer = _select_payload_buffer(node);
+    if (buffer == NULL) return spn_PAYLOAD_BUFFERS_BUSY;
+
+    bool more_pending = false;
+    bool made;
+    if (node->vars.mqtt_connected) {
+        made = makeNDATAPart(node->timestamp_function(), node->vars.sequence, &more_pending);
+    } else {
+        made = makeHistoricalNDATAPart(node->timestamp_function(), node->vars.sequence, &more_pending);
+    }
+    if (!made) {
+        _clear_pending_payloads(node);
+        _clear_mqtt_message(node);
+        return spn_MAKE_NDATA_FAILED;
+    }
+
+    _set_mqtt_message(node, buffer, node->topics.NDATA, 0, buffer->written_length);
+    node->vars.ndata_parts_pending = more_pending;
+
+    if (more_pending) {
+        if (node->vars.mqtt_connected) return spn_NDATA_PART_READY;
+        return spn_HISTORICAL_NDATA_PART_READY;
+    }
+    if (node->vars.mqtt_connected) return spn_NDATA_PL_READY;
+    return spn_HISTORICAL_NDATA_PL_READY;
+}
+
 static void _increment_bdseq(int64_t* bdseq_ptr) {
     if (bdseq_ptr == NULL) return;
 
@@ -215,6 +783,9 @@ static void _increment_bdseq(int64_t* bdseq_ptr) {
 
 SparkplugNodeState makeNDEATHPayload(SparkplugNodeConfig* node) {
     // if (node == NULL) return false;
+    _use_node_context(node);
+    BufferValue* buffer = _select_payload_buffer(node);
+    if (buffer == NULL) return spn_PAYLOAD_BUFFERS_BUSY;
 
     // check if it is initial connect or not
     if (node->vars.initial_birth_made) {
@@ -224,19 +795,328 @@ SparkplugNodeState makeNDEATHPayload(SparkplugNodeConfig* node) {
     readBasicTag(node->node_tags.bd_seq, node->timestamp_function());
 
     if (makeNDEATH(node->timestamp_function())) {
-        node->mqtt_message.payload = &(node->payload_buffer);
-        node->mqtt_message.topic = node->topics.NDEATH;
+        _set_mqtt_message(node, buffer, node->topics.NDEATH, 0, buffer->written_length);
         return spn_NDEATH_PL_READY;
     }
-    node->mqtt_message.payload = NULL;
-    node->mqtt_message.topic = NULL;
+    _clear_mqtt_message(node);
     return spn_MAKE_NDEATH_FAILED;
 }
 
 
-SparkplugNodeState tickSparkplugNode(SparkplugNodeConfig* node) {
-    if (node == NULL) return spn_ERROR_NODE_NULL;
-    if (!scanDue(node)) return spn_SCAN_NOT_DUE;
+static SparkplugNodeState _make_device_payload(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, BufferValue* buffer) {
+    setSparkplugContext(device->context);
+    setEncodeBuffer(buffer);
+    uint64_t timestamp = node->timestamp_function();
+    const char* topic;
+    SparkplugNodeState ready;
+    bool made;
+    if (device->death_pending) {
+        device->death_pending = false;
+        topic = device->topics.DDEATH;
+        ready = spn_DDEATH_PL_READY;
+        made = makeDDEATH(timestamp, node->vars.sequence);
+    } else if (device->birth_pending) {
+        // The birth carries the current values, a change found by the last scan needs no DDATA
+        device->birth_pending = false;
+        device->values_changed = false;
+        topic = device->topics.DBIRTH;
+        if (node->vars.mqtt_connected) {
+            ready = spn_DBIRTH_PL_READY;
+            made = makeNBIRTH(timestamp, node->vars.sequence);
+        } else {
+            ready = spn_HISTORICAL_DBIRTH_PL_READY;
+            made = makeHistoricalNBIRTH(timestamp, node->vars.sequence);
+        }
+    } else {
+        device->values_changed = false;
+        topic = device->topics.DDATA;
+        if (node->vars.mqtt_connected) {
+            ready = spn_DDATA_PL_READY;
+            made = makeNDATA(timestamp, node->vars.sequence);
+        } else {
+            ready = spn_HISTORICAL_DDATA_PL_READY;
+            made = makeHistoricalNDATA(timestamp, node->vars.sequence);
+        }
+    }
+    _use_node_context(node);
+    if (!made) {
+        _clear_mqtt_message(node);
+        return spn_MAKE_DEVICE_PAYLOAD_FAILED;
+    }
+    _set_mqtt_message(node, buffer, topic, 0, buffer->written_length);
+    return ready;
+}
+
+
+static SparkplugNodeState _next_device_payload(SparkplugNodeConfig* node, BufferValue* buffer) {
+    /*
+    Makes the payload of the next device with something to send, spn_VALUES_UNCHANGED if none has.
+    Nothing is sent before the NBIRTH or while a rebirth is due
+    */
+    struct Devices* devices = &(node->devices);
+    if (!(devices->nbirth_made) || *(node->vars.rebirth_tag_value)) return spn_VALUES_UNCHANGED;
+    for (size_t i = 0; i < devices->count; i++) {
+        size_t idx = (devices->next + i) % devices->count;
+        SparkplugDeviceConfig* device = devices->list[idx];
+        // The host already saw the node go offline
+        if (device->death_pending && !(node->vars.mqtt_connected)) device->death_pending = false;
+        if (!(device->death_pending || device->birth_pending || device->values_changed)) continue;
+        devices->next = (idx + 1) % devices->count;
+        return _make_device_payload(node, device, buffer);
+    }
+    return spn_VALUES_UNCHANGED;
+}
+
+
+/*
+Store and forward
+
+Historical NDATA and DDATA payloads made while MQTT is down are appended to the node's history
+store instead of being handed to the application. A record is the device id length and the device
+id (empty for the node), then the payload without its seq field, which is always written last.
+Once reconnected and the NBIRTH and DBIRTHs are out, the records are read back in order, one at a
+time straight into a payload buffer, each with the seq of the new session.
+
+With history_batch_ms the node and each device accumulate their historical payloads in a batch
+first: the metrics of each following scan are appended to the first payload, which keeps its
+timestamp, and the batch becomes one record once it is full, too old, or MQTT reconnects.
+*/
+
+static size_t _seq_field_length(uint8_t sequence) {
+    // Key and varint, the key of field 3 is one byte
+    return sequence < 128 ? 2 : 3;
+}
+
+static size_t _timestamp_field_length(const uint8_t* payload, size_t length) {
+    // Length of the payload timestamp field a payload starts with, 0 if there is none
+    if (length == 0 || payload[0] != ((Payload_timestamp_tag << 3) | PB_WT_VARINT)) return 0;
+    for (size_t i = 1; i < length && i < 11; i++) {
+        if (!(payload[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+static bool _history_append(SparkplugNodeConfig* node, const char* device_id, const uint8_t* payload, size_t length) {
+    size_t id_length = device_id != NULL ? strlen(device_id) : 0;
+    if (id_length > UINT8_MAX) return false;
+    uint8_t head[UINT8_MAX + 1];
+    head[0] = (uint8_t)id_length;
+    if (id_length > 0) memcpy(&head[1], device_id, id_length);
+    return node->history->append(node->history, head, 1 + id_length, payload, length);
+}
+
+static void _flush_history_batch(SparkplugNodeConfig* node, SparkplugHistoryBatch* batch, const char* device_id) {
+    if (node->history == NULL || batch->samples == 0) return;
+    if (!_history_append(node, device_id, batch->data, batch->length)) node->history->dropped += batch->samples;
+    batch->length = 0;
+    batch->samples = 0;
+}
+
+static void _flush_history_batches(SparkplugNodeConfig* node, bool expired_only) {
+    /* Stores the batches of the node and its devices, or only those older than history_batch_ms */
+    if (node->history == NULL || node->history_batch_ms == 0) return;
+    uint64_t now = expired_only ? node->timestamp_function() : 0;
+    SparkplugHistoryBatch* batch = &(node->history_batch);
+    if (!expired_only || (batch->samples > 0 && now - batch->started >= node->history_batch_ms)) _flush_history_batch(node, batch, NULL);
+    for (size_t i = 0; i < node->devices.count; i++) {
+        batch = &(node->devices.list[i]->history_batch);
+        if (!expired_only || (batch->samples > 0 && now - batch->started >= node->history_batch_ms)) {
+            _flush_history_batch(node, batch, node->devices.list[i]->device_id);
+        }
+    }
+}
+
+static bool _history_batch_add(SparkplugNodeConfig* node, SparkplugHistoryBatch* batch, const char* device_id, const uint8_t* payload, size_t length) {
+    /* Appends a historical payload's metrics to the batch, storing the batch first if they don't fit */
+    size_t size = node->history_batch_size;
+    if (batch->samples > 0) {
+        size_t skip = _timestamp_field_length(payload, length);
+        if (batch->length + length - skip <= size) {
+            memcpy(&(batch->data[batch->length]), &payload[skip], length - skip);
+            batch->length += length - skip;
+            batch->samples++;
+            return true;
+        }
+        _flush_history_batch(node, batch, device_id);
+    }
+    if (batch->data == NULL && length <= size) batch->data = (uint8_t*)malloc(size);
+    if (batch->data == NULL || length > size) return _history_append(node, device_id, payload, length);
+    memcpy(batch->data, payload, length);
+    batch->length = length;
+    batch->samples = 1;
+    batch->started = node->timestamp_function();
+    return true;
+}
+
+static bool _history_store(SparkplugNodeConfig* node, SparkplugDeviceConfig* device) {
+    /* Stores the payload of node->mqtt_message without its seq, false if it was dropped */
+    BufferValue* payload = node->mqtt_message.payload;
+    size_t seq_length = _seq_field_length(node->vars.sequence);
+    if (payload->written_length < seq_length) return false;
+    if (payload->buffer[payload->written_length - seq_length] != ((Payload_seq_tag << 3) | PB_WT_VARINT)) return false;
+    size_t length = payload->written_length - seq_length;
+    const char* device_id = device != NULL ? device->device_id : NULL;
+    if (node->history_batch_ms == 0) return _history_append(node, device_id, payload->buffer, length);
+    SparkplugHistoryBatch* batch = device != NULL ? &(device->history_batch) : &(node->history_batch);
+    return _history_batch_add(node, batch, device_id, payload->buffer, length);
+}
+
+static bool _device_births_pending(SparkplugNodeConfig* node) {
+    for (size_t i = 0; i < node->devices.count; i++) {
+        if (node->devices.list[i]->birth_pending || node->devices.list[i]->death_pending) return true;
+    }
+    return false;
+}
+
+static void _refill_replay_credit(int64_t* credit, size_t per_second, uint64_t elapsed) {
+    // Credit is in thousandths, per_second of them every ms, at most a second's worth is saved up
+    int64_t limit = (int64_t)per_second * 1000;
+    *credit += (int64_t)(elapsed * per_second);
+    if (*credit > limit) *credit = limit;
+}
+
+static bool _replay_allowed(SparkplugNodeConfig* node) {
+    /* A stored payload may go out once the previous ones are paid for, so one is never held back for being large */
+    struct Replay* replay = &(node->replay);
+    if (replay->bytes_per_second == 0 && replay->messages_per_second == 0) return true;
+    uint64_t now = node->timestamp_function();
+    uint64_t elapsed = now > replay->last_refill ? now - replay->last_refill : 0;
+    if (elapsed > 1000) elapsed = 1000;
+    replay->last_refill = now;
+    _refill_replay_credit(&(replay->byte_credit), replay->bytes_per_second, elapsed);
+    _refill_replay_credit(&(replay->message_credit), replay->messages_per_second, elapsed);
+    if (replay->bytes_per_second > 0 && replay->byte_credit < 0) return false;
+    if (replay->messages_per_second > 0 && replay->message_credit < 0) return false;
+    return true;
+}
+
+static const char* _stored_topic(SparkplugNodeConfig* node, size_t record_length, uint8_t* id_length) {
+    /* Topic of the oldest stored record, NULL if it can't be sent */
+    SparkplugHistoryStore* history = node->history;
+    *id_length = 0;
+    if (!history->read(history, 0, id_length, 1) || 1 + (size_t)(*id_length) >= record_length) return NULL;
+    if (*id_length == 0) return node->topics.NDATA;
+    char device_id[UINT8_MAX + 1];
+    if (!history->read(history, 1, (uint8_t*)device_id, *id_length)) return NULL;
+    device_id[*id_length] = '\0';
+    SparkplugDeviceConfig* device = spnGetDevice(node, device_id);
+    return device != NULL ? device->topics.DDATA : NULL;
+}
+
+static size_t _stored_timestamp_length(SparkplugHistoryStore* history, size_t offset, size_t length) {
+    // Length of the payload timestamp field a stored payload starts with
+    uint8_t bytes[11];
+    size_t count = length < sizeof(bytes) ? length : sizeof(bytes);
+    if (count == 0 || !history->read(history, offset, bytes, count)) return 0;
+    return _timestamp_field_length(bytes, count);
+}
+
+static size_t _merge_stored_payloads(SparkplugNodeConfig* node, BufferValue* buffer, const char* topic, size_t length, size_t seq_length) {
+    /*
+    Appends the metrics of the following stored payloads for the same topic to the payload in
+    buffer while they fit, returns its new length. The metrics keep their own timestamps, the
+    payload keeps the timestamp of the first
+    */
+    SparkplugHistoryStore* history = node->history;
+    size_t record_length;
+    while ((record_length = history->oldest(history)) > 0) {
+        uint8_t id_length;
+        if (_stored_topic(node, record_length, &id_length) != topic) break;
+        size_t offset = 1 + (size_t)id_length;
+        size_t skip = _stored_timestamp_length(history, offset, record_length - offset);
+        size_t metrics_length = record_length - offset - skip;
+        if (length + metrics_length + seq_length > buffer->allocated_length) break;
+        if (!history->read(history, offset + skip, &(buffer->buffer[length]), metrics_length)) break;
+        history->drop(history);
+        length += metrics_length;
+    }
+    return length;
+}
+
+static SparkplugNodeState _next_stored_payload(SparkplugNodeConfig* node, BufferValue* buffer) {
+    /*
+    Makes the oldest stored payload the next message, spn_VALUES_UNCHANGED if none can be sent yet.
+    Records of deleted devices, and records the new seq no longer fits, are dropped
+    */
+    SparkplugHistoryStore* history = node->history;
+    if (history == NULL || !(node->vars.mqtt_connected)) return spn_VALUES_UNCHANGED;
+    if (!(node->devices.nbirth_made) || *(node->vars.rebirth_tag_value) || _device_births_pending(node)) return spn_VALUES_UNCHANGED;
+    if (history->oldest(history) == 0 || !_replay_allowed(node)) return spn_VALUES_UNCHANGED;
+
+    size_t record_length;
+    while ((record_length = history->oldest(history)) > 0) {
+        uint8_t id_length;
+        const char* topic = _stored_topic(node, record_length, &id_length);
+        size_t payload_length = record_length - 1 - id_length;
+        size_t seq_length = _seq_field_length(node->vars.sequence);
+        if (topic == NULL || payload_length + seq_length > buffer->allocated_length || !history->read(history, 1 + id_length, buffer->buffer, payload_length)) {
+            history->drop(history);
+            history->dropped++;
+            continue;
+        }
+        history->drop(history);
+        if (node->replay.merge) payload_length = _merge_stored_payloads(node, buffer, topic, payload_length, seq_length);
+
+        pb_ostream_t stream = pb_ostream_from_buffer(&(buffer->buffer[payload_length]), seq_length);
+        pb_encode_tag(&stream, PB_WT_VARINT, Payload_seq_tag);
+        pb_encode_varint(&stream, node->vars.sequence);
+        buffer->written_length = payload_length + seq_length;
+        node->replay.byte_credit -= (int64_t)buffer->written_length * 1000;
+        node->replay.message_credit -= 1000;
+        node->replay.live_sent = false;
+        _set_mqtt_message(node, buffer, topic, 0, buffer->written_length);
+        return spn_STORED_PL_READY;
+    }
+    return spn_VALUES_UNCHANGED;
+}
+
+static SparkplugDeviceConfig* _message_device(SparkplugNodeConfig* node) {
+    for (size_t i = 0; i < node->devices.count; i++) {
+        if (node->mqtt_message.topic == node->devices.list[i]->topics.DDATA) return node->devices.list[i];
+    }
+    return NULL;
+}
+
+
+static SparkplugNodeState _tick_sparkplug_node(SparkplugNodeConfig* node) {
+    _use_node_context(node);
+
+    // Finish a split payload before scanning again
+    if (node->vars.nbirth_fragments_pending) return _next_nbirth_fragment(node);
+    if (node->vars.ndata_parts_pending) return _next_ndata_part(node);
+
+    // Write queued NCMDs here, the scan that follows reports them
+    if (node->ncmd_queue.data != NULL) {
+        size_t applied = 0;
+        setDecodeArena(node->ncmd_arena, node->ncmd_arena_size);
+        applyNCMDQueue(&(node->ncmd_queue), NULL, node->vars.staged_ncmd, &applied);
+        if (applied > 0) node->vars.force_scan = true;
+    }
+
+    // Don't consume a scan while there is nowhere to encode its changes
+    BufferValue* buffer = _select_payload_buffer(node);
+    if (buffer == NULL) return spn_PAYLOAD_BUFFERS_BUSY;
+
+    // Device payloads of the last scan or birth go out before the next scan
+    SparkplugNodeState device_state = _next_device_payload(node, buffer);
+    if (device_state != spn_VALUES_UNCHANGED) return device_state;
+
+    // Live data goes first, but every live NDATA is followed by a stored payload when the rate allows,
+    // so a backlog drains even while every scan has changes
+    if (node->replay.live_sent) {
+        node->replay.live_sent = false;
+        SparkplugNodeState stored_state = _next_stored_payload(node, buffer);
+        if (stored_state != spn_VALUES_UNCHANGED) return stored_state;
+    }
+
+    // Stored payloads follow the births of the new session and fill the ticks between scans
+    if (!scanDue(node)) {
+        SparkplugNodeState stored_state = _next_stored_payload(node, buffer);
+        return stored_state != spn_VALUES_UNCHANGED ? stored_state : spn_SCAN_NOT_DUE;
+    }
+
+    // A birth reports every tag, so every class is read for it
+    if (*(node->vars.rebirth_tag_value) || !node->vars.initial_birth_made) node->scan_classes.due = SPARKPLUG_ALL_SCAN_CLASSES;
 
     // Scan Tags
     if (!scanTags(node)) {
@@ -250,39 +1130,95 @@ SparkplugNodeState tickSparkplugNode(SparkplugNodeConfig* node) {
         *(node->vars.rebirth_tag_value) = false;
         readBasicTag(node->node_tags.rebirth, node->timestamp_function());
 
+        if (node->vars.split_payloads) {
+            SparkplugNodeState state = _next_nbirth_fragment(node);
+            if (state != spn_MAKE_NBIRTH_FAILED) _rebirth_devices(node);
+            return state;
+        }
+
         // check if payload was made
         if (!_make_nbirth_payload(node)) {
-            node->mqtt_message.payload = NULL;
-            node->mqtt_message.topic = NULL;
+            _clear_mqtt_message(node);
             return spn_MAKE_NBIRTH_FAILED;
         }
+        _rebirth_devices(node);
 
-        node->mqtt_message.payload = &(node->payload_buffer);
-        node->mqtt_message.topic = node->topics.NBIRTH;
+        _set_mqtt_message(node, buffer, node->topics.NBIRTH, 0, buffer->written_length);
         if (node->vars.mqtt_connected) return spn_NBIRTH_PL_READY;
         return spn_HISTORICAL_NBIRTH_PL_READY;
     }
 
     if (!(node->vars.values_changed)) {
-        node->mqtt_message.payload = NULL;
-        node->mqtt_message.topic = NULL;
-        return spn_VALUES_UNCHANGED;
+        // Only devices may have changed
+        device_state = _next_device_payload(node, buffer);
+        if (device_state != spn_VALUES_UNCHANGED) return device_state;
+        _clear_mqtt_message(node);
+        return _next_stored_payload(node, buffer);
     }
 
+    if (node->vars.split_payloads) return _next_ndata_part(node);
+
     if (!_make_ndata_payload(node)) {
-        node->mqtt_message.payload = NULL;
-        node->mqtt_message.topic = NULL;
+        _clear_mqtt_message(node);
         return spn_MAKE_NDATA_FAILED;
     }
 
-    node->mqtt_message.payload = &(node->payload_buffer);
-    node->mqtt_message.topic = node->topics.NDATA;
+    _set_mqtt_message(node, buffer, node->topics.NDATA, 0, buffer->written_length);
     if (node->vars.mqtt_connected) return spn_NDATA_PL_READY;
     return spn_HISTORICAL_NDATA_PL_READY;
 }
 
 
+SparkplugNodeState tickSparkplugNode(SparkplugNodeConfig* node) {
+    if (node == NULL) return spn_ERROR_NODE_NULL;
+    SparkplugNodeState state = _tick_sparkplug_node(node);
+    if (node->history == NULL) return state;
+    if (state == spn_NDATA_PL_READY || state == spn_NDATA_PART_READY || state == spn_DDATA_PL_READY) node->replay.live_sent = true;
+    _flush_history_batches(node, true);
+    if (state != spn_HISTORICAL_NDATA_PL_READY && state != spn_HISTORICAL_NDATA_PART_READY && state != spn_HISTORICAL_DDATA_PL_READY) return state;
+
+    // Kept for the next session instead of handed to the application
+    bool stored = _history_store(node, _message_device(node));
+    if (!stored) node->history->dropped++;
+    spnReleasePayload(node, node->mqtt_message.payload);
+    _clear_mqtt_message(node);
+    return stored ? spn_HISTORICAL_PL_STORED : spn_HISTORICAL_PL_DROPPED;
+}
+
+
+size_t spnEstimateNBIRTHSize(SparkplugNodeConfig* node) {
+    if (node == NULL) return 0;
+    _use_node_context(node);
+    // Same sequence rule as _make_nbirth_payload
+    int sequence = _USE_SPARKPLUG_3 ? node->vars.sequence : 0;
+    if (node->vars.mqtt_connected) return getNBIRTHSize(node->timestamp_function(), sequence);
+    return getHistoricalNBIRTHSize(node->timestamp_function(), sequence);
+}
+
+
+size_t spnEstimateNDATASize(SparkplugNodeConfig* node) {
+    if (node == NULL) return 0;
+    _use_node_context(node);
+    if (node->vars.mqtt_connected) return getNDATASize(node->timestamp_function(), node->vars.sequence);
+    return getHistoricalNDATASize(node->timestamp_function(), node->vars.sequence);
+}
+
+
 SparkplugNodeState processIncomingNCMDPayload(SparkplugNodeConfig* node, uint8_t* buffer, size_t length) {
+    if (node->ncmd_queue.data != NULL) {
+        // Written by tickSparkplugNode, nothing else of the node is touched here
+        if (queueNCMD(&(node->ncmd_queue), buffer, length)) return spn_PROCESS_NCMD_SUCCESS;
+        return spn_PROCESS_NCMD_FAILED;
+    }
+    _use_node_context(node);
+    setDecodeArena(node->ncmd_arena, node->ncmd_arena_size);
+    if (node->vars.staged_ncmd) {
+        // Scan once after the whole NCMD is written, a rejected NCMD changed nothing
+        size_t written = 0;
+        bool committed = processNCMDStaged(buffer, length, NULL, &written);
+        if (written > 0) node->vars.force_scan = true;
+        return committed ? spn_PROCESS_NCMD_SUCCESS : spn_PROCESS_NCMD_FAILED;
+    }
     // flag for immediate scan
     node->vars.force_scan = true;
     if (processNCMD(buffer, length, NULL)) return spn_PROCESS_NCMD_SUCCESS;
@@ -290,6 +1226,51 @@ SparkplugNodeState processIncomingNCMDPayload(SparkplugNodeConfig* node, uint8_t
 }
 
 
+SparkplugNodeState processIncomingDCMDPayload(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, uint8_t* buffer, size_t length) {
+    if (node == NULL) return spn_ERROR_NODE_NULL;
+    if (device == NULL) return spn_PROCESS_NCMD_FAILED;
+    setSparkplugContext(device->context);
+    setDecodeArena(node->ncmd_arena, node->ncmd_arena_size);
+    bool result;
+    size_t written = 0;
+    if (node->vars.staged_ncmd) {
+        result = processNCMDStaged(buffer, length, NULL, &written);
+    } else {
+        result = processNCMD(buffer, length, NULL);
+        written = 1;
+    }
+    _use_node_context(node);
+    // The scan picks up the written tags, the device's DDATA follows it
+    if (written > 0) node->vars.force_scan = true;
+    return result ? spn_PROCESS_NCMD_SUCCESS : spn_PROCESS_NCMD_FAILED;
+}
+
+
+bool spnNCMDFeed(SparkplugNodeConfig* node, const uint8_t* chunk, size_t length) {
+    if (node == NULL || node->ncmd_stream.buffer == NULL) return false;
+    // The mode is taken at the start of each NCMD
+    if (!(node->ncmd_stream.started)) node->ncmd_stream.staged = node->vars.staged_ncmd;
+    _use_node_context(node);
+    setDecodeArena(node->ncmd_arena, node->ncmd_arena_size);
+    return feedNCMDStream(&(node->ncmd_stream), chunk, length);
+}
+
+
+SparkplugNodeState spnNCMDFinish(SparkplugNodeConfig* node) {
+    if (node == NULL) return spn_ERROR_NODE_NULL;
+    if (node->ncmd_stream.buffer == NULL) return spn_PROCESS_NCMD_FAILED;
+    _use_node_context(node);
+    setDecodeArena(node->ncmd_arena, node->ncmd_arena_size);
+    bool staged = node->ncmd_stream.staged;
+    bool started = node->ncmd_stream.started;
+    size_t written = 0;
+    bool result = finishNCMDStream(&(node->ncmd_stream), &written);
+    // Same as processIncomingNCMDPayload, metrics written as they were fed may have changed tags
+    if (staged ? written > 0 : started) node->vars.force_scan = true;
+    return result ? spn_PROCESS_NCMD_SUCCESS : spn_PROCESS_NCMD_FAILED;
+}
+
+
 /*
 Sparkplug Events
 */
@@ -302,6 +1283,11 @@ static void _on_publish_payload(SparkplugNodeConfig* node) {
 void spnOnMQTTConnected(SparkplugNodeConfig* node) {
     if (node == NULL) return;
     node->vars.mqtt_connected = true;
+    // Accumulated scans are stored behind the rest, replay starts after the births
+    _flush_history_batches(node, false);
+    // The new session starts with an NBIRTH, drop what's left of a split payload
+    _clear_pending_payloads(node);
+    node->devices.nbirth_made = false;
     if (node->vars.initial_birth_made) {
         // flag rebirth on next tick
         *(node->vars.rebirth_tag_value) = true;
@@ -311,6 +1297,7 @@ void spnOnMQTTConnected(SparkplugNodeConfig* node) {
 void spnOnMQTTDisconnected(SparkplugNodeConfig* node) {
     if (node == NULL) return;
     node->vars.mqtt_connected = false;
+    _clear_pending_payloads(node);
 }
 
 
@@ -322,4 +1309,18 @@ void spnOnPublishNBIRTH(SparkplugNodeConfig* node) {
 
 void spnOnPublishNDATA(SparkplugNodeConfig* node) {
     _on_publish_payload(node);
+}
+
+void spnOnPublishDevicePayload(SparkplugNodeConfig* node) {
+    _on_publish_payload(node);
+}
+
+bool spnReleasePayload(SparkplugNodeConfig* node, BufferValue* payload) {
+    if (node == NULL || payload == NULL) return false;
+    struct PayloadBuffers* ring = &(node->payload_buffers);
+    if (payload < ring->buffers || payload >= ring->buffers + ring->count) return false;
+    // A single buffer is never held, nothing to release
+    if (ring->count < 2) return true;
+    __atomic_store_n(&(ring->in_use[payload - ring->buffers]), false, __ATOMIC_RELEASE);
+    return true;
 }
\ No newline at end of file
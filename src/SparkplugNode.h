@@ -23,6 +23,7 @@ extern "C" {
 
 #include <BasicTag.h>
 #include "EmbeddedSparkplugPayloads.h"
+#include "SparkplugHistory.h"
 
 /* For future version
 typedef struct SparkplugMQTTBrokerDetails {
@@ -36,18 +37,73 @@ typedef struct SparkplugMQTTBrokerDetails {
 
 typedef struct SparkplugNodeConfig SparkplugNodeConfig;
 typedef struct SparkplugMQTTMessage SparkplugMQTTMessage;
+typedef struct SparkplugDeviceConfig SparkplugDeviceConfig;
+
+// Historical payloads of successive scans accumulated into one, see history_batch_ms
+typedef struct {
+    uint8_t* data;  // The first payload without its seq field, followed by the metrics of the later ones
+    size_t length;
+    size_t samples;  // Payloads accumulated
+    uint64_t started;  // When the first was accumulated
+} SparkplugHistoryBatch;
+
+typedef struct {
+    size_t payload_buffer_size;
+    uint8_t payload_buffer_count;  // 2 or more keeps each payload's buffer until spnReleasePayload
+    size_t ncmd_arena_size;  // Scratch memory for decoding NCMD metrics, 0 decodes on the heap
+    size_t ncmd_stream_buffer_size;  // Largest metric of an NCMD fed with spnNCMDFeed, 0 disables it
+    size_t ncmd_queue_length;  // Metrics queued by processIncomingNCMDPayload for tickSparkplugNode to write, 0 writes them directly
+    size_t ncmd_queue_slot_size;  // Largest encoded metric the queue accepts
+    bool own_tags;  // The node gets its own context and tag set (see spnAddTag), any number of such nodes can run, but not alongside a node without own_tags
+    size_t history_buffer_size;  // Bytes of historical NDATA/DDATA kept in RAM while MQTT is down and sent after reconnecting, 0 disables it (see spnSetHistoryStore)
+    SparkplugHistoryOverflow history_overflow;
+    size_t replay_bytes_per_second;  // Limits on sending stored payloads after reconnecting, 0 doesn't limit
+    size_t replay_messages_per_second;
+    bool replay_merge;  // Stored payloads of the same node or device are merged into payloads up to the payload buffer size
+    uint32_t history_batch_ms;  // Offline scans are accumulated into one historical payload for up to this long, 0 stores each scan
+    size_t history_batch_size;  // Largest accumulated payload, 0 uses the payload buffer size
+} SparkplugNodeOptions;
 
 struct SparkplugMQTTMessage {
     const char* topic;
     BufferValue* payload;
+    size_t offset;  // Position of payload in the full message, only non zero for NBIRTH fragments
+    size_t total_length;  // Length of the full message
 }; 
 
+// A Sparkplug device of a node, with its own tags and report by exception state
+struct SparkplugDeviceConfig {
+    const char* device_id;
+    SparkplugContext* context;  // The device's tag set, birth cache and changed tag list
+    struct DeviceTopics {
+        const char* DCMD;
+        const char* DBIRTH;
+        const char* DDEATH;
+        const char* DDATA;
+    } topics;
+    bool online;  // Offline devices are not scanned or reported, see spnSetDeviceOnline
+    bool birth_pending;
+    bool death_pending;
+    bool values_changed;  // Changes found by the last scan, not yet sent in a DDATA
+    SparkplugHistoryBatch history_batch;
+};
+
 
 struct SparkplugNodeConfig {
     const char* node_id;
     const char* group_id;
     const char* tags_group;  // For future version of BasicTag
-    BufferValue payload_buffer;
+    SparkplugContext* context;  // Own context with own_tags, NULL uses the default context
+    struct PayloadBuffers {
+        BufferValue* buffers;
+        bool* in_use;  // Set while a published payload is owned by the application, cleared by spnReleasePayload
+        uint8_t count;
+        uint8_t next;
+    } payload_buffers;
+    uint8_t* ncmd_arena;
+    size_t ncmd_arena_size;
+    SparkplugNCMDStream ncmd_stream;
+    SparkplugNCMDQueue ncmd_queue;
     TimestampFunction timestamp_function;
     struct Topics {
         const char* NCMD;
@@ -70,8 +126,40 @@ struct SparkplugNodeConfig {
         uint8_t sequence;
         bool initial_birth_made;
         bool mqtt_connected;
+        bool split_payloads;  // Split payloads that don't fit in a payload buffer instead of failing
+        bool staged_ncmd;  // Apply an NCMD all or nothing instead of writing metrics as they are decoded
+        bool ndata_parts_pending;
+        bool nbirth_fragments_pending;
+        uint64_t pending_timestamp;
+        size_t pending_offset;
+        size_t pending_total_length;
     } vars;
+    struct ScanClasses {
+        uint32_t rates[SPARKPLUG_SCAN_CLASSES];  // Milliseconds, 0 scans with class 0 at the Scan Rate tag's rate
+        uint64_t last_scan[SPARKPLUG_SCAN_CLASSES];
+        uint32_t due;  // Classes read by the next scanTags, set by scanDue
+    } scan_classes;
     SparkplugMQTTMessage mqtt_message;
+    struct Devices {
+        SparkplugDeviceConfig** list;
+        size_t count;
+        size_t allocated;
+        size_t next;  // Device checked first for the next device payload, so every device gets a turn
+        bool nbirth_made;  // Device payloads wait for the session's NBIRTH
+    } devices;
+    SparkplugHistoryStore* history;  // Store and forward, NULL hands historical payloads to the application
+    struct Replay {
+        size_t bytes_per_second;
+        size_t messages_per_second;
+        bool merge;
+        int64_t byte_credit;  // Thousandths of a byte, spent by each stored payload sent
+        int64_t message_credit;
+        uint64_t last_refill;
+        bool live_sent;  // Live data went out since the last stored payload, the backlog gets the next slot
+    } replay;
+    SparkplugHistoryBatch history_batch;
+    uint32_t history_batch_ms;
+    size_t history_batch_size;
 };
 
 
@@ -89,7 +177,21 @@ typedef enum {
     spn_PROCESS_NCMD_FAILED = 9,
     spn_PROCESS_NCMD_SUCCESS = 10,
     spn_HISTORICAL_NBIRTH_PL_READY = 11,
-    spn_HISTORICAL_NDATA_PL_READY = 12
+    spn_HISTORICAL_NDATA_PL_READY = 12,
+    spn_NDATA_PART_READY = 13,
+    spn_HISTORICAL_NDATA_PART_READY = 14,
+    spn_NBIRTH_FRAGMENT_READY = 15,
+    spn_HISTORICAL_NBIRTH_FRAGMENT_READY = 16,
+    spn_PAYLOAD_BUFFERS_BUSY = 17,
+    spn_DBIRTH_PL_READY = 18,
+    spn_HISTORICAL_DBIRTH_PL_READY = 19,
+    spn_DDATA_PL_READY = 20,
+    spn_HISTORICAL_DDATA_PL_READY = 21,
+    spn_DDEATH_PL_READY = 22,
+    spn_MAKE_DEVICE_PAYLOAD_FAILED = 23,
+    spn_HISTORICAL_PL_STORED = 24,
+    spn_HISTORICAL_PL_DROPPED = 25,
+    spn_STORED_PL_READY = 26
 } SparkplugNodeState;
 
 
@@ -100,13 +202,63 @@ Initializer functions
 */
 SparkplugNodeConfig* createSparkplugNode(const char* group_id, const char* node_id, size_t payload_buffer_size, TimestampFunction timestamp_function);
 
+// Options used by createSparkplugNode, one payload buffer and a SPARKPLUG_DECODE_ARENA_SIZE NCMD arena
+SparkplugNodeOptions spnDefaultNodeOptions(size_t payload_buffer_size);
+
+// With payload_buffer_count >= 2 each ready payload keeps its buffer until spnReleasePayload is called,
+// the next payload is encoded into another buffer while the previous one is still being published
+SparkplugNodeConfig* createSparkplugNodeWithOptions(const char* group_id, const char* node_id, const SparkplugNodeOptions* options, TimestampFunction timestamp_function);
+
 bool deleteSparkplugNode(SparkplugNodeConfig* sparkplug_node);
 
+// Tags of a node created with own_tags, a tag can belong to several nodes. Remove a tag before deleting it
+bool spnAddTag(SparkplugNodeConfig* node, FunctionalBasicTag* tag);
+
+bool spnRemoveTag(SparkplugNodeConfig* node, FunctionalBasicTag* tag);
+
+// Tags start in scan class 0, read at the Scan Rate tag's rate
+bool spnSetTagScanClass(SparkplugNodeConfig* node, FunctionalBasicTag* tag, uint8_t scan_class);
+
+// Rate of scan classes 1 to SPARKPLUG_SCAN_CLASSES - 1, 0 scans the class with class 0
+bool spnSetScanClassRate(SparkplugNodeConfig* node, uint8_t scan_class, uint32_t rate_ms);
+
+// The node owns the store and closes it with the node or the next store, NULL disables store and forward
+bool spnSetHistoryStore(SparkplugNodeConfig* node, SparkplugHistoryStore* store);
+
+
+/*
+Device Functions, need a node created with own_tags
+*/
+
+SparkplugDeviceConfig* spnAddDevice(SparkplugNodeConfig* node, const char* device_id);
+
+// Frees the device, set it offline and publish its DDEATH first
+bool spnDeleteDevice(SparkplugNodeConfig* node, SparkplugDeviceConfig* device);
+
+SparkplugDeviceConfig* spnGetDevice(SparkplugNodeConfig* node, const char* device_id);
+
+// Adding or removing a tag rebirths only that device
+bool spnAddDeviceTag(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, FunctionalBasicTag* tag);
+
+bool spnRemoveDeviceTag(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, FunctionalBasicTag* tag);
+
+// Device tags use the node's scan class rates
+bool spnSetDeviceTagScanClass(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, FunctionalBasicTag* tag, uint8_t scan_class);
+
+bool spnRebirthDevice(SparkplugNodeConfig* node, SparkplugDeviceConfig* device);
+
+// Offline sends a DDEATH, back online a DBIRTH
+bool spnSetDeviceOnline(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, bool online);
+
+// Same states as processIncomingNCMDPayload. DCMDs are never queued, call it from the task ticking the node
+SparkplugNodeState processIncomingDCMDPayload(SparkplugNodeConfig* node, SparkplugDeviceConfig* device, uint8_t* buffer, size_t length);
+
 
 /*
 Node Functions
 */
 
+// True when any scan class is due, scanTags then reads the tags of the due classes
 bool scanDue(SparkplugNodeConfig* node);
 
 bool scanTags(SparkplugNodeConfig* node);
@@ -116,8 +268,22 @@ SparkplugNodeState makeNDEATHPayload(SparkplugNodeConfig* node);
 
 SparkplugNodeState tickSparkplugNode(SparkplugNodeConfig* node);
 
+// With an NCMD queue only the queue is touched, so it can be called from the MQTT client's task
+// while another task calls tickSparkplugNode, which writes the queued metrics before scanning
 SparkplugNodeState processIncomingNCMDPayload(SparkplugNodeConfig* node, uint8_t* buffer, size_t length);
 
+// Incoming NCMD in chunks, as it is read from the MQTT client. Feed every chunk in order, then
+// spnNCMDFinish returns the same states as processIncomingNCMDPayload. Needs ncmd_stream_buffer_size
+bool spnNCMDFeed(SparkplugNodeConfig* node, const uint8_t* chunk, size_t length);
+
+SparkplugNodeState spnNCMDFinish(SparkplugNodeConfig* node);
+
+// Exact encoded length of the next NBIRTH / NDATA for the current tag state, 0 on failure.
+// The NDATA size covers the changes found by the last scan
+size_t spnEstimateNBIRTHSize(SparkplugNodeConfig* node);
+
+size_t spnEstimateNDATASize(SparkplugNodeConfig* node);
+
 /*
 Sparkplug Events
 */
@@ -129,6 +295,12 @@ void spnOnPublishNBIRTH(SparkplugNodeConfig* node);
 
 void spnOnPublishNDATA(SparkplugNodeConfig* node);
 
+// After publishing a DBIRTH, DDATA or DDEATH
+void spnOnPublishDevicePayload(SparkplugNodeConfig* node);
+
+// Hand a payload buffer back to the node once the MQTT client is done with it, safe to call from another task
+bool spnReleasePayload(SparkplugNodeConfig* node, BufferValue* payload);
+
 
 #ifdef __cplusplus
 }